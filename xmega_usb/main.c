@@ -9,9 +9,22 @@
 #include <util/delay.h>
 #include "usb.h"
 #include "hid.h"
+#include "msc.h"
+#include "dfu.h"
+
+#ifdef USB_REGMAP
+// example registers, see regmap_table in usb_config.h
+uint16_t example_gain = 1;
+int16_t example_offset;
+uint32_t example_sample_count;
+#endif
 
 int main(void)
 {
+#ifdef USB_DFU_MODE
+	dfu_start_application();		// returns if the bootloader should run
+#endif
+
 	usb_configure_clock();
 
 	// debug USART
@@ -33,20 +46,44 @@ int main(void)
 
 	usb_init();
 
+#ifdef USB_DFU_MODE
+	// the bootloader's interrupt vectors are at the start of the boot section
+	CCPWrite(&PMIC.CTRL, PMIC_IVSEL_bm | PMIC_LOLVLEN_bm | PMIC_MEDLVLEN_bm | PMIC_HILVLEN_bm);
+#else
 	PMIC.CTRL = PMIC_LOLVLEN_bm | PMIC_MEDLVLEN_bm | PMIC_HILVLEN_bm;
+#endif
 	sei();
 
 	usb_attach();
 
 #ifdef USB_HID
+	uint8_t report[USB_HID_REPORT_SIZE] = { 0 };
 	for(;;)
 	{
-		for (uint8_t i = 0; i < USB_HID_REPORT_SIZE; i++)
-			hid_report[i] += (i+1);
+#ifdef USB_DEFERRED_CONTROL
+		usb_poll();
+#endif
 		//_delay_ms(50);
-		hid_send_report();
+		// Never blocks. Fails if the queue is full, unless USB_HID_COALESCE replaces the
+		// newest waiting report, so only move on to the next sample once this one is queued.
+		if (hid_post_report(HID_DEFAULT_ID, report))
+		{
+			for (uint8_t i = 0; i < USB_HID_REPORT_SIZE; i++)
+				report[i] += (i+1);
+		}
 	}
 #endif
 
-	for(;;);
+	for(;;)
+	{
+#ifdef USB_DEFERRED_CONTROL
+		usb_poll();
+#endif
+#ifdef USB_MSC
+		msc_poll();
+#endif
+#ifdef USB_DFU_MODE
+		dfu_poll();
+#endif
+	}
 }
@@ -0,0 +1,121 @@
+/* cdc.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Communications Device Class, abstract control model (virtual serial port). The data
+ * interface uses the streaming bulk endpoints (0x81 IN, 0x02 OUT), so data is sent with
+ * usb_stream_in_write() and received with usb_stream_out_read(). Serial state changes
+ * are reported on the interrupt endpoint 0x83.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "usb.h"
+#include "usb_config.h"
+#include "usb_xmega.h"
+#include "cdc.h"
+
+#ifdef USB_CDC
+
+#if defined(USB_HID) || defined(USB_ISOCHRONOUS) || defined(USB_DMA_IN)
+#error USB_CDC needs the vendor bulk endpoints and endpoint 0x83, undefine USB_HID, USB_ISOCHRONOUS and USB_DMA_IN
+#endif
+
+CDC_LineCoding_t cdc_line_coding = {
+	.dwDTERate = 115200,
+	.bCharFormat = 0,
+	.bParityType = 0,
+	.bDataBits = 8
+};
+uint8_t cdc_line_state;
+
+static CDC_SerialStateNotification_t cdc_notification __attribute__((__aligned__(2)));
+static volatile bool cdc_notification_busy;		// cdc_notification is armed on the endpoint
+
+
+/* Endpoint completion callback, the host has collected the notification
+ */
+static void cdc_notification_complete(usb_ep ep)
+{
+	cdc_notification_busy = false;
+}
+
+/* Called on USB reset
+ */
+void cdc_reset(void)
+{
+	usb_ep_enable(CDC_NOTIFICATION_EP, USB_EP_TYPE_BULK_gc, CDC_NOTIFICATION_EP_SIZE, true);
+	usb_ep_set_callback(CDC_NOTIFICATION_EP, cdc_notification_complete);
+	cdc_notification_busy = false;
+	cdc_line_state = 0;
+}
+
+/* Handle class requests for the communications interface
+ */
+void cdc_control_setup(void)
+{
+	switch (usb_setup.bRequest)
+	{
+		// OUT requests
+		case CDC_SET_LINE_CODING:
+			if (usb_setup.wLength < sizeof(CDC_LineCoding_t))
+				return usb_ep0_stall();
+			memcpy(&cdc_line_coding, ep0_buf_out, sizeof(CDC_LineCoding_t));
+			cdc_cb_set_line_coding(cdc_line_coding.dwDTERate, cdc_line_coding.bCharFormat,
+								   cdc_line_coding.bParityType, cdc_line_coding.bDataBits);
+			usb_ep0_in(0);
+			return usb_ep0_clear_out_setup();
+
+		case CDC_SET_CONTROL_LINE_STATE:
+			cdc_line_state = usb_setup.wValue;
+			cdc_cb_set_control_line_state(cdc_line_state);
+			usb_ep0_in(0);
+			return usb_ep0_out();
+
+		case CDC_SEND_BREAK:
+			cdc_cb_send_break(usb_setup.wValue);
+			usb_ep0_in(0);
+			return usb_ep0_out();
+
+		// IN requests
+		case CDC_GET_LINE_CODING:
+		{
+			uint8_t size = sizeof(CDC_LineCoding_t);
+			if (size > usb_setup.wLength)
+				size = usb_setup.wLength;
+			memcpy(ep0_buf_in, &cdc_line_coding, sizeof(CDC_LineCoding_t));
+			usb_ep0_in(size);
+			return usb_ep0_out();
+		}
+
+		default:
+			return usb_ep0_stall();
+	}
+}
+
+/* Report UART status lines and errors (CDC_SERIAL_STATE_*) to the host. Returns false if
+ * the previous notification hasn't been collected yet.
+ */
+bool cdc_send_serial_state(uint16_t state)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	if (cdc_notification_busy)
+	{
+		SREG = saved_sreg;
+		return false;
+	}
+	cdc_notification_busy = true;
+	SREG = saved_sreg;
+
+	cdc_notification.bmRequestType = 0xA1;		// class, interface, device to host
+	cdc_notification.bNotification = CDC_NOTIFY_SERIAL_STATE;
+	cdc_notification.wValue = 0;
+	cdc_notification.wIndex = CDC_COMM_INTERFACE;
+	cdc_notification.wLength = 2;
+	cdc_notification.wSerialState = state;
+	usb_ep_start_in(CDC_NOTIFICATION_EP, (uint8_t *)&cdc_notification, sizeof(cdc_notification), false);
+	return true;
+}
+
+#endif // USB_CDC
@@ -0,0 +1,117 @@
+/* cdc.h
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Communications Device Class, abstract control model (virtual serial port)
+ */
+
+#ifndef CDC_H_
+#define CDC_H_
+
+
+// CDC_COMM_INTERFACE and CDC_DATA_INTERFACE are numbered in usb.h
+#define CDC_NOTIFICATION_EP					0x83
+#define CDC_NOTIFICATION_EP_SIZE			16
+
+// USB descriptors
+#define CDC_INTERFACE_CLASS_COMM			0x02
+#define CDC_INTERFACE_SUBCLASS_ACM			0x02
+#define CDC_INTERFACE_PROTOCOL_AT			0x01
+#define CDC_INTERFACE_CLASS_DATA			0x0A
+
+#define CDC_DTYPE_CS_INTERFACE				0x24
+#define CDC_DSUBTYPE_HEADER					0x00
+#define CDC_DSUBTYPE_CALL_MANAGEMENT		0x01
+#define CDC_DSUBTYPE_ACM					0x02
+#define CDC_DSUBTYPE_UNION					0x06
+
+#define CDC_ACM_CAP_LINE_CODING_bm			(1<<1)	// line coding, control line state, serial state
+#define CDC_ACM_CAP_SEND_BREAK_bm			(1<<2)
+
+typedef struct
+{
+	uint8_t		bFunctionLength;
+	uint8_t		bDescriptorType;
+	uint8_t		bDescriptorSubtype;
+	uint16_t	bcdCDC;
+} __attribute__ ((packed)) CDC_HeaderDescriptor_t;
+
+typedef struct
+{
+	uint8_t		bFunctionLength;
+	uint8_t		bDescriptorType;
+	uint8_t		bDescriptorSubtype;
+	uint8_t		bmCapabilities;
+	uint8_t		bDataInterface;
+} __attribute__ ((packed)) CDC_CallManagementDescriptor_t;
+
+typedef struct
+{
+	uint8_t		bFunctionLength;
+	uint8_t		bDescriptorType;
+	uint8_t		bDescriptorSubtype;
+	uint8_t		bmCapabilities;
+} __attribute__ ((packed)) CDC_ACMDescriptor_t;
+
+typedef struct
+{
+	uint8_t		bFunctionLength;
+	uint8_t		bDescriptorType;
+	uint8_t		bDescriptorSubtype;
+	uint8_t		bMasterInterface;
+	uint8_t		bSlaveInterface0;
+} __attribute__ ((packed)) CDC_UnionDescriptor_t;
+
+
+// CDC requests
+#define CDC_SET_LINE_CODING					0x20
+#define CDC_GET_LINE_CODING					0x21
+#define CDC_SET_CONTROL_LINE_STATE			0x22
+#define CDC_SEND_BREAK						0x23
+
+typedef struct
+{
+	uint32_t	dwDTERate;
+	uint8_t		bCharFormat;		// 0 = 1 stop bit, 1 = 1.5, 2 = 2
+	uint8_t		bParityType;		// 0 = none, 1 = odd, 2 = even, 3 = mark, 4 = space
+	uint8_t		bDataBits;
+} __attribute__ ((packed)) CDC_LineCoding_t;
+
+// SET_CONTROL_LINE_STATE wValue
+#define CDC_LINE_STATE_DTR_bm				(1<<0)
+#define CDC_LINE_STATE_RTS_bm				(1<<1)
+
+
+// Notifications
+#define CDC_NOTIFY_SERIAL_STATE				0x20
+
+typedef struct
+{
+	uint8_t		bmRequestType;
+	uint8_t		bNotification;
+	uint16_t	wValue;
+	uint16_t	wIndex;
+	uint16_t	wLength;
+	uint16_t	wSerialState;
+} __attribute__ ((packed)) CDC_SerialStateNotification_t;
+
+#define CDC_SERIAL_STATE_DCD_bm				(1<<0)
+#define CDC_SERIAL_STATE_DSR_bm				(1<<1)
+#define CDC_SERIAL_STATE_BREAK_bm			(1<<2)
+#define CDC_SERIAL_STATE_RING_bm			(1<<3)
+#define CDC_SERIAL_STATE_FRAMING_bm			(1<<4)
+#define CDC_SERIAL_STATE_PARITY_bm			(1<<5)
+#define CDC_SERIAL_STATE_OVERRUN_bm			(1<<6)
+
+
+#ifdef USB_CDC
+extern CDC_LineCoding_t	cdc_line_coding;
+extern uint8_t			cdc_line_state;
+
+extern void	cdc_reset(void);
+extern void	cdc_control_setup(void);
+extern bool	cdc_send_serial_state(uint16_t state);
+#endif
+
+
+#endif /* CDC_H_ */
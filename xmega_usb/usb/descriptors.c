@@ -14,14 +14,72 @@
 #include "usb.h"
 #include "usb_xmega.h"
 #include "dfu.h"
+#include "usb_iso.h"
+#include "cdc.h"
+#include "msc.h"
+#include "hid.h"
+#include "usb_composite.h"
 #include "xmega.h"
 #undef HID_DECLARE_REPORT_DESCRIPTOR
 
-#ifdef USB_HID
-USB_ENDPOINTS(1);
+/**************************************************************************************************
+* Endpoint table, sized for the highest endpoint number in the descriptors. Each function's
+* term is built from the same address macros its endpoint descriptors use, 0 if absent.
+*/
+#define EP_NUM(ep)		((ep) & 0x0F)
+#define EP_MAX(a, b)	((a) > (b) ? (a) : (b))
+
+#if defined(USB_COMPOSITE)
+#define MAIN_ENDPOINTS	USB_COMPOSITE_ENDPOINTS
+#elif defined(USB_MAIN_OUT_EP)
+#define MAIN_ENDPOINTS	EP_MAX(EP_NUM(USB_MAIN_IN_EP), EP_NUM(USB_MAIN_OUT_EP))
+#elif defined(USB_MAIN_IN_EP)
+#define MAIN_ENDPOINTS	EP_NUM(USB_MAIN_IN_EP)
+#else
+#define MAIN_ENDPOINTS	0		// control pipe only
+#endif
+
+#ifdef USB_CDC
+#define CDC_ENDPOINTS	EP_NUM(CDC_NOTIFICATION_EP)
+#else
+#define CDC_ENDPOINTS	0
+#endif
+
+#ifdef USB_ISOCHRONOUS
+#define ISO_ENDPOINTS	EP_MAX(EP_NUM(USB_ISO_IN_EP), EP_NUM(USB_ISO_OUT_EP))
 #else
-USB_ENDPOINTS(2);
+#define ISO_ENDPOINTS	0
+#endif
+
+#define USB_NUM_ENDPOINTS	EP_MAX(MAIN_ENDPOINTS, EP_MAX(CDC_ENDPOINTS, ISO_ENDPOINTS))
+
+USB_ENDPOINTS(USB_NUM_ENDPOINTS);
+
+
+/**************************************************************************************************
+* String indexes, looked up in usb_string_address() below
+*/
+enum {
+	STRING_LANGUAGE,
+	STRING_MANUFACTURER,
+	STRING_PRODUCT,
+#ifdef USB_SERIAL_NUMBER
+	STRING_SERIAL,
+#endif
+#ifdef USB_DFU_RUNTIME
+	STRING_DFU_RUNTIME,
+#endif
+#ifdef USB_DFU_MODE
+	STRING_DFU_FLASH,
+	STRING_DFU_EEPROM,
 #endif
+#ifdef USB_DFU_PATCH
+	STRING_DFU_PATCH,
+#endif
+	STRING_COUNT
+};
+
+#define STRING_MSFT		0xEE		// fixed by the WCID specification
 
 
 /**************************************************************************************************
@@ -31,24 +89,35 @@ const __flash USB_DeviceDescriptor_t device_descriptor = {
 	.bLength				= sizeof(USB_DeviceDescriptor_t),
 	.bDescriptorType		= USB_DTYPE_Device,
 
+#ifdef USB_WCID_MSOS20
+	.bcdUSB                 = 0x0201,		// has a BOS descriptor
+#else
 	.bcdUSB                 = 0x0200,
-#ifdef USB_HID
+#endif
+#if defined(USB_CDC) || defined(USB_COMPOSITE)
+	// functions are grouped by interface association descriptors
+	.bDeviceClass           = USB_CSCP_IADDeviceClass,
+	.bDeviceSubClass        = USB_CSCP_IADDeviceSubclass,
+	.bDeviceProtocol        = USB_CSCP_IADDeviceProtocol,
+#elif defined(USB_HID) || defined(USB_MSC) || defined(USB_DFU_MODE)
 	.bDeviceClass           = USB_CSCP_NoDeviceClass,
+	.bDeviceSubClass        = USB_CSCP_NoDeviceSubclass,
+	.bDeviceProtocol        = USB_CSCP_NoDeviceProtocol,
 #else
 	.bDeviceClass           = USB_CSCP_VendorSpecificClass,
-#endif
 	.bDeviceSubClass        = USB_CSCP_NoDeviceSubclass,
 	.bDeviceProtocol        = USB_CSCP_NoDeviceProtocol,
+#endif
 
 	.bMaxPacketSize0        = USB_EP0_MAX_PACKET_SIZE,
 	.idVendor               = USB_VID,
 	.idProduct              = USB_PID,
 	.bcdDevice              = (USB_VERSION_MAJOR << 8) | (USB_VERSION_MINOR),
 
-	.iManufacturer          = 0x01,
-	.iProduct               = 0x02,
+	.iManufacturer          = STRING_MANUFACTURER,
+	.iProduct               = STRING_PRODUCT,
 #ifdef USB_SERIAL_NUMBER
-	.iSerialNumber          = 0x03,
+	.iSerialNumber          = STRING_SERIAL,
 #else
 	.iSerialNumber          = 0x00,
 #endif
@@ -60,12 +129,34 @@ const __flash USB_DeviceDescriptor_t device_descriptor = {
 /**************************************************************************************************
 * USB configuration descriptor
 */
+#ifndef USB_COMPOSITE
 typedef struct {
 	USB_ConfigurationDescriptor_t	Config;
+#ifdef USB_CDC
+	USB_InterfaceAssociationDescriptor_t	CDC_IAD;
+#endif
+#ifndef USB_DFU_MODE
 	USB_InterfaceDescriptor_t		Interface0;
-#ifdef USB_HID
+#endif
+#ifdef USB_DFU_MODE
+	USB_InterfaceDescriptor_t		DFU_intf_flash;
+	USB_InterfaceDescriptor_t		DFU_intf_eeprom;
+#ifdef USB_DFU_PATCH
+	USB_InterfaceDescriptor_t		DFU_intf_patch;
+#endif
+	DFU_FunctionalDescriptor_t		DFU_desc_mode;
+#elif defined(USB_HID)
 	USB_HIDDescriptor_t				HIDDescriptor;
 	USB_EndpointDescriptor_t		HIDInEndpoint;
+#elif defined(USB_CDC)
+	CDC_HeaderDescriptor_t			CDC_header;
+	CDC_CallManagementDescriptor_t	CDC_call_management;
+	CDC_ACMDescriptor_t				CDC_acm;
+	CDC_UnionDescriptor_t			CDC_union;
+	USB_EndpointDescriptor_t		CDCNotificationEndpoint;
+	USB_InterfaceDescriptor_t		CDC_intf_data;
+	USB_EndpointDescriptor_t		DataInEndpoint;
+	USB_EndpointDescriptor_t		DataOutEndpoint;
 #else
 	USB_EndpointDescriptor_t		DataInEndpoint;
 	USB_EndpointDescriptor_t		DataOutEndpoint;
@@ -74,10 +165,14 @@ typedef struct {
 	USB_InterfaceDescriptor_t		DFU_intf_runtime;
 	DFU_FunctionalDescriptor_t		DFU_desc_runtime;
 #endif
+#ifdef USB_ISOCHRONOUS
+	USB_InterfaceDescriptor_t		ISO_intf_alt0;
+	USB_InterfaceDescriptor_t		ISO_intf_alt1;
+	USB_EndpointDescriptor_t		ISOInEndpoint;
+	USB_EndpointDescriptor_t		ISOOutEndpoint;
+#endif
 } ConfigDesc_t;
 
-_Static_assert(sizeof(ConfigDesc_t) <= USB_EP0_BUFFER_SIZE, "Configuration descriptor exceeds EP0 buffer size");
-
 
 /**************************************************************************************************
 * USB configuration descriptor
@@ -87,17 +182,73 @@ const __flash ConfigDesc_t configuration_descriptor = {
 		.bLength = sizeof(USB_ConfigurationDescriptor_t),
 		.bDescriptorType = USB_DTYPE_Configuration,
 		.wTotalLength  = sizeof(ConfigDesc_t),
-#ifdef USB_DFU_RUNTIME
-		.bNumInterfaces = 2,
-#else
-		.bNumInterfaces = 1,
-#endif
+		.bNumInterfaces = USB_NUM_INTERFACES,
 		.bConfigurationValue = 1,
 		.iConfiguration = 0,
+#ifdef USB_REMOTE_WAKEUP
+		.bmAttributes = USB_CONFIG_ATTR_BUSPOWERED | USB_CONFIG_ATTR_REMOTEWAKEUP,
+#else
 		.bmAttributes = USB_CONFIG_ATTR_BUSPOWERED,
+#endif
 		.bMaxPower = USB_CONFIG_POWER_MA(100)
 	},
-#ifdef USB_HID
+#ifdef USB_CDC
+	.CDC_IAD = {
+		.bLength = sizeof(USB_InterfaceAssociationDescriptor_t),
+		.bDescriptorType = USB_DTYPE_InterfaceAssociation,
+		.bFirstInterface = CDC_COMM_INTERFACE,
+		.bInterfaceCount = 2,
+		.bFunctionClass = CDC_INTERFACE_CLASS_COMM,
+		.bFunctionSubClass = CDC_INTERFACE_SUBCLASS_ACM,
+		.bFunctionProtocol = CDC_INTERFACE_PROTOCOL_AT,
+		.iFunction = 0
+	},
+#endif
+#ifdef USB_DFU_MODE
+	.DFU_intf_flash = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = DFU_INTERFACE,
+		.bAlternateSetting = DFU_ALT_FLASH,
+		.bNumEndpoints = 0,
+		.bInterfaceClass = DFU_INTERFACE_CLASS,
+		.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+		.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
+		.iInterface = STRING_DFU_FLASH
+	},
+	.DFU_intf_eeprom = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = DFU_INTERFACE,
+		.bAlternateSetting = DFU_ALT_EEPROM,
+		.bNumEndpoints = 0,
+		.bInterfaceClass = DFU_INTERFACE_CLASS,
+		.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+		.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
+		.iInterface = STRING_DFU_EEPROM
+	},
+#ifdef USB_DFU_PATCH
+	.DFU_intf_patch = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = DFU_INTERFACE,
+		.bAlternateSetting = DFU_ALT_PATCH,
+		.bNumEndpoints = 0,
+		.bInterfaceClass = DFU_INTERFACE_CLASS,
+		.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+		.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
+		.iInterface = STRING_DFU_PATCH
+	},
+#endif
+	.DFU_desc_mode = {
+		.bLength = sizeof(DFU_FunctionalDescriptor_t),
+		.bDescriptorType = DFU_DESCRIPTOR_TYPE,
+		.bmAttributes = (DFU_ATTR_CANDOWNLOAD_bm | DFU_ATTR_CANUPLOAD_bm | DFU_ATTR_WILLDETACH_bm),
+		.wDetachTimeout = 0,
+		.wTransferSize = DFU_TRANSFER_SIZE,
+		.bcdDFUVersion = 0x0101
+	},
+#elif defined(USB_HID)
 	.Interface0 = {
 		.bLength = sizeof(USB_InterfaceDescriptor_t),
 		.bDescriptorType = USB_DTYPE_Interface,
@@ -121,11 +272,84 @@ const __flash ConfigDesc_t configuration_descriptor = {
 	.HIDInEndpoint = {
 		.bLength = sizeof(USB_EndpointDescriptor_t),
 		.bDescriptorType = USB_DTYPE_Endpoint,
-		.bEndpointAddress = 0x81,
+		.bEndpointAddress = USB_MAIN_IN_EP,
 		.bmAttributes = (USB_EP_TYPE_INTERRUPT),
 		.wMaxPacketSize = 64,
 		.bInterval = USB_HID_POLL_RATE_MS
 	},
+#elif defined(USB_CDC)
+	.Interface0 = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = CDC_COMM_INTERFACE,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 1,
+		.bInterfaceClass = CDC_INTERFACE_CLASS_COMM,
+		.bInterfaceSubClass = CDC_INTERFACE_SUBCLASS_ACM,
+		.bInterfaceProtocol = CDC_INTERFACE_PROTOCOL_AT,
+		.iInterface = 0
+	},
+	.CDC_header = {
+		.bFunctionLength = sizeof(CDC_HeaderDescriptor_t),
+		.bDescriptorType = CDC_DTYPE_CS_INTERFACE,
+		.bDescriptorSubtype = CDC_DSUBTYPE_HEADER,
+		.bcdCDC = 0x0110
+	},
+	.CDC_call_management = {
+		.bFunctionLength = sizeof(CDC_CallManagementDescriptor_t),
+		.bDescriptorType = CDC_DTYPE_CS_INTERFACE,
+		.bDescriptorSubtype = CDC_DSUBTYPE_CALL_MANAGEMENT,
+		.bmCapabilities = 0,
+		.bDataInterface = CDC_DATA_INTERFACE
+	},
+	.CDC_acm = {
+		.bFunctionLength = sizeof(CDC_ACMDescriptor_t),
+		.bDescriptorType = CDC_DTYPE_CS_INTERFACE,
+		.bDescriptorSubtype = CDC_DSUBTYPE_ACM,
+		.bmCapabilities = CDC_ACM_CAP_LINE_CODING_bm | CDC_ACM_CAP_SEND_BREAK_bm
+	},
+	.CDC_union = {
+		.bFunctionLength = sizeof(CDC_UnionDescriptor_t),
+		.bDescriptorType = CDC_DTYPE_CS_INTERFACE,
+		.bDescriptorSubtype = CDC_DSUBTYPE_UNION,
+		.bMasterInterface = CDC_COMM_INTERFACE,
+		.bSlaveInterface0 = CDC_DATA_INTERFACE
+	},
+	.CDCNotificationEndpoint = {
+		.bLength = sizeof(USB_EndpointDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Endpoint,
+		.bEndpointAddress = CDC_NOTIFICATION_EP,
+		.bmAttributes = (USB_EP_TYPE_INTERRUPT),
+		.wMaxPacketSize = CDC_NOTIFICATION_EP_SIZE,
+		.bInterval = 0x10
+	},
+	.CDC_intf_data = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = CDC_DATA_INTERFACE,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = CDC_INTERFACE_CLASS_DATA,
+		.bInterfaceSubClass = 0x00,
+		.bInterfaceProtocol = 0x00,
+		.iInterface = 0
+	},
+	.DataInEndpoint = {
+		.bLength = sizeof(USB_EndpointDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Endpoint,
+		.bEndpointAddress = USB_MAIN_IN_EP,
+		.bmAttributes = (USB_EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+		.wMaxPacketSize = 64,
+		.bInterval = 0x00
+	},
+	.DataOutEndpoint = {
+		.bLength = sizeof(USB_EndpointDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Endpoint,
+		.bEndpointAddress = USB_MAIN_OUT_EP,
+		.bmAttributes = (USB_EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+		.wMaxPacketSize = 64,
+		.bInterval = 0x00
+	},
 #else
 	.Interface0 = {
 		.bLength = sizeof(USB_InterfaceDescriptor_t),
@@ -133,15 +357,21 @@ const __flash ConfigDesc_t configuration_descriptor = {
 		.bInterfaceNumber = 0,
 		.bAlternateSetting = 0,
 		.bNumEndpoints = 2,
+#ifdef USB_MSC
+		.bInterfaceClass = MSC_INTERFACE_CLASS,
+		.bInterfaceSubClass = MSC_INTERFACE_SUBCLASS_SCSI,
+		.bInterfaceProtocol = MSC_INTERFACE_PROTOCOL_BOT,
+#else
 		.bInterfaceClass = USB_CSCP_VendorSpecificClass,
 		.bInterfaceSubClass = 0x00,
 		.bInterfaceProtocol = 0x00,
+#endif
 		.iInterface = 0
 	},
 	.DataInEndpoint = {
 		.bLength = sizeof(USB_EndpointDescriptor_t),
 		.bDescriptorType = USB_DTYPE_Endpoint,
-		.bEndpointAddress = 0x81,
+		.bEndpointAddress = USB_MAIN_IN_EP,
 		.bmAttributes = (USB_EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 		.wMaxPacketSize = 64,
 		.bInterval = 0x00
@@ -149,7 +379,7 @@ const __flash ConfigDesc_t configuration_descriptor = {
 	.DataOutEndpoint = {
 		.bLength = sizeof(USB_EndpointDescriptor_t),
 		.bDescriptorType = USB_DTYPE_Endpoint,
-		.bEndpointAddress = 0x2,
+		.bEndpointAddress = USB_MAIN_OUT_EP,
 		.bmAttributes = (USB_EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 		.wMaxPacketSize = 64,
 		.bInterval = 0x00
@@ -159,13 +389,13 @@ const __flash ConfigDesc_t configuration_descriptor = {
 	.DFU_intf_runtime = {
 		.bLength = sizeof(USB_InterfaceDescriptor_t),
 		.bDescriptorType = USB_DTYPE_Interface,
-		.bInterfaceNumber = 1,
+		.bInterfaceNumber = DFU_INTERFACE,
 		.bAlternateSetting = 0,
 		.bNumEndpoints = 0,
 		.bInterfaceClass = DFU_INTERFACE_CLASS,
 		.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
 		.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_RUNTIME,
-		.iInterface = 0x10
+		.iInterface = STRING_DFU_RUNTIME
 	},
 	.DFU_desc_runtime = {
 		.bLength = sizeof(DFU_FunctionalDescriptor_t),
@@ -176,7 +406,215 @@ const __flash ConfigDesc_t configuration_descriptor = {
 		.bcdDFUVersion = 0x0101
 	},
 #endif
+#ifdef USB_ISOCHRONOUS
+	// alternate setting 0 has no endpoints, so it takes no bus bandwidth
+	.ISO_intf_alt0 = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = USB_ISO_INTERFACE,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 0,
+		.bInterfaceClass = USB_CSCP_VendorSpecificClass,
+		.bInterfaceSubClass = 0x00,
+		.bInterfaceProtocol = 0x00,
+		.iInterface = 0
+	},
+	.ISO_intf_alt1 = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = USB_ISO_INTERFACE,
+		.bAlternateSetting = 1,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = USB_CSCP_VendorSpecificClass,
+		.bInterfaceSubClass = 0x00,
+		.bInterfaceProtocol = 0x00,
+		.iInterface = 0
+	},
+	.ISOInEndpoint = {
+		.bLength = sizeof(USB_EndpointDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Endpoint,
+		.bEndpointAddress = USB_ISO_IN_EP,
+		.bmAttributes = (USB_EP_TYPE_ISOCHRONOUS | ENDPOINT_ATTR_ASYNC | ENDPOINT_USAGE_DATA),
+		.wMaxPacketSize = USB_ISO_IN_SIZE,
+		.bInterval = 0x01
+	},
+	.ISOOutEndpoint = {
+		.bLength = sizeof(USB_EndpointDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Endpoint,
+		.bEndpointAddress = USB_ISO_OUT_EP,
+		.bmAttributes = (USB_EP_TYPE_ISOCHRONOUS | ENDPOINT_ATTR_ASYNC | ENDPOINT_USAGE_DATA),
+		.wMaxPacketSize = USB_ISO_OUT_SIZE,
+		.bInterval = 0x01
+	},
+#endif
+};
+#endif // !USB_COMPOSITE
+
+
+/**************************************************************************************************
+* Composite device functions. Each function's descriptors are numbered as if it were the
+* only one, interfaces from 0 and endpoints from 1. The configuration descriptor is
+* generated from them by usb_composite.c.
+*/
+#ifdef USB_COMPOSITE
+const __flash USB_ConfigurationDescriptor_t usb_composite_config_header = {
+	.bLength = sizeof(USB_ConfigurationDescriptor_t),
+	.bDescriptorType = USB_DTYPE_Configuration,
+	.wTotalLength  = 0,
+	.bNumInterfaces = 0,
+	.bConfigurationValue = 1,
+	.iConfiguration = 0,
+#ifdef USB_REMOTE_WAKEUP
+	.bmAttributes = USB_CONFIG_ATTR_BUSPOWERED | USB_CONFIG_ATTR_REMOTEWAKEUP,
+#else
+	.bmAttributes = USB_CONFIG_ATTR_BUSPOWERED,
+#endif
+	.bMaxPower = USB_CONFIG_POWER_MA(100)
+};
+
+#ifdef USB_HID
+typedef struct {
+	USB_InterfaceDescriptor_t		Interface;
+	USB_HIDDescriptor_t				HIDDescriptor;
+	USB_EndpointDescriptor_t		HIDInEndpoint;
+} HIDFunctionDesc_t;
+
+const __flash HIDFunctionDesc_t hid_function_descriptors = {
+	.Interface = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 1,
+		.bInterfaceClass = USB_CSCP_HIDClass,
+		.bInterfaceSubClass = USB_CSCP_HIDNoSubclass,
+		.bInterfaceProtocol = USB_CSCP_HIDNoProtocol,
+		.iInterface = 0
+	},
+	.HIDDescriptor = {
+		.bLength = sizeof(USB_HIDDescriptor_t),
+		.bDescriptorType = USB_DTYPE_HID,
+		.bcdHID = 0x0111,
+		.bCountryCode = 0,
+		.bNumDescriptors = 1,
+		.bReportDescriptorType = USB_DTYPE_Report,
+		.wDescriptorLength = sizeof(hid_report_descriptor),
+	},
+	.HIDInEndpoint = {
+		.bLength = sizeof(USB_EndpointDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Endpoint,
+		.bEndpointAddress = 0x81,		// relative to the function's first endpoint
+		.bmAttributes = (USB_EP_TYPE_INTERRUPT),
+		.wMaxPacketSize = 64,
+		.bInterval = USB_HID_POLL_RATE_MS
+	},
+};
+
+const __flash usb_function_t usb_hid_function = {
+	.descriptors = (const __flash uint8_t *)&hid_function_descriptors,
+	.descriptors_length = sizeof(HIDFunctionDesc_t),
+	.num_interfaces = USB_FUNCTION_HID_INTERFACES,
+	.num_endpoints = USB_FUNCTION_HID_ENDPOINTS,
+	.function_class = USB_CSCP_HIDClass,
+	.function_subclass = USB_CSCP_HIDNoSubclass,
+	.function_protocol = USB_CSCP_HIDNoProtocol,
+	.reset = hid_reset,
+	.setup = hid_control_setup,
+	.set_interface = NULL
+};
+#endif // USB_HID
+
+typedef struct {
+	USB_InterfaceDescriptor_t		Interface;
+	USB_EndpointDescriptor_t		DataInEndpoint;
+	USB_EndpointDescriptor_t		DataOutEndpoint;
+} VendorFunctionDesc_t;
+
+const __flash VendorFunctionDesc_t vendor_function_descriptors = {
+	.Interface = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = USB_CSCP_VendorSpecificClass,
+		.bInterfaceSubClass = 0x00,
+		.bInterfaceProtocol = 0x00,
+		.iInterface = 0
+	},
+	.DataInEndpoint = {
+		.bLength = sizeof(USB_EndpointDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Endpoint,
+		.bEndpointAddress = 0x81,		// relative to the function's first endpoint
+		.bmAttributes = (USB_EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+		.wMaxPacketSize = 64,
+		.bInterval = 0x00
+	},
+	.DataOutEndpoint = {
+		.bLength = sizeof(USB_EndpointDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Endpoint,
+		.bEndpointAddress = 0x2,		// relative to the function's first endpoint
+		.bmAttributes = (USB_EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+		.wMaxPacketSize = 64,
+		.bInterval = 0x00
+	},
+};
+
+const __flash usb_function_t usb_vendor_function = {
+	.descriptors = (const __flash uint8_t *)&vendor_function_descriptors,
+	.descriptors_length = sizeof(VendorFunctionDesc_t),
+	.num_interfaces = USB_FUNCTION_VENDOR_INTERFACES,
+	.num_endpoints = USB_FUNCTION_VENDOR_ENDPOINTS,
+	.function_class = USB_CSCP_VendorSpecificClass,
+	.function_subclass = 0x00,
+	.function_protocol = 0x00,
+	.reset = usb_vendor_reset,
+	.setup = NULL,
+	.set_interface = NULL
+};
+
+#ifdef USB_DFU_RUNTIME
+typedef struct {
+	USB_InterfaceDescriptor_t		Interface;
+	DFU_FunctionalDescriptor_t		Functional;
+} DFURuntimeFunctionDesc_t;
+
+const __flash DFURuntimeFunctionDesc_t dfu_runtime_function_descriptors = {
+	.Interface = {
+		.bLength = sizeof(USB_InterfaceDescriptor_t),
+		.bDescriptorType = USB_DTYPE_Interface,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 0,
+		.bInterfaceClass = DFU_INTERFACE_CLASS,
+		.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+		.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_RUNTIME,
+		.iInterface = STRING_DFU_RUNTIME
+	},
+	.Functional = {
+		.bLength = sizeof(DFU_FunctionalDescriptor_t),
+		.bDescriptorType = DFU_DESCRIPTOR_TYPE,
+		.bmAttributes = (DFU_ATTR_CANDOWNLOAD_bm | DFU_ATTR_WILLDETACH_bm),
+		.wDetachTimeout = 0,
+		.wTransferSize = APP_SECTION_PAGE_SIZE,
+		.bcdDFUVersion = 0x0101
+	},
+};
+
+const __flash usb_function_t usb_dfu_runtime_function = {
+	.descriptors = (const __flash uint8_t *)&dfu_runtime_function_descriptors,
+	.descriptors_length = sizeof(DFURuntimeFunctionDesc_t),
+	.num_interfaces = USB_FUNCTION_DFU_RUNTIME_INTERFACES,
+	.num_endpoints = USB_FUNCTION_DFU_RUNTIME_ENDPOINTS,
+	.function_class = DFU_INTERFACE_CLASS,
+	.function_subclass = DFU_INTERFACE_SUBCLASS,
+	.function_protocol = DFU_INTERFACE_PROTOCOL_RUNTIME,
+	.reset = NULL,
+	.setup = dfu_control_setup,
+	.set_interface = NULL
 };
+#endif // USB_DFU_RUNTIME
+#endif // USB_COMPOSITE
 
 
 /**************************************************************************************************
@@ -203,9 +641,6 @@ const __flash USB_StringDescriptor_t product_string = {
 	.bString = USTRING(USB_STRING_PRODUCT)
 };
 
-_Static_assert(sizeof(language_string) <= USB_EP0_BUFFER_SIZE, "Language string exceeds EP0 buffer size");
-_Static_assert(sizeof(manufacturer_string) <= USB_EP0_BUFFER_SIZE, "Language string exceeds EP0 buffer size");
-_Static_assert(sizeof(product_string) <= USB_EP0_BUFFER_SIZE, "Language string exceeds EP0 buffer size");
 
 #ifdef USB_DFU_RUNTIME
 const __flash USB_StringDescriptor_t dfu_runtime_string = {
@@ -213,9 +648,54 @@ const __flash USB_StringDescriptor_t dfu_runtime_string = {
 	.bDescriptorType = USB_DTYPE_String,
 	.bString = u"Runtime"
 };
-_Static_assert(sizeof(dfu_runtime_string) <= USB_EP0_BUFFER_SIZE, "DFU runtime string exceeds EP0 buffer size");
 #endif // USB_DFU_RUNTIME
 
+#ifdef USB_DFU_MODE
+const __flash USB_StringDescriptor_t dfu_flash_string = {
+	.bLength = USB_STRING_LEN("Flash"),
+	.bDescriptorType = USB_DTYPE_String,
+	.bString = u"Flash"
+};
+
+const __flash USB_StringDescriptor_t dfu_eeprom_string = {
+	.bLength = USB_STRING_LEN("EEPROM"),
+	.bDescriptorType = USB_DTYPE_String,
+	.bString = u"EEPROM"
+};
+#endif // USB_DFU_MODE
+
+#ifdef USB_DFU_PATCH
+const __flash USB_StringDescriptor_t dfu_patch_string = {
+	.bLength = USB_STRING_LEN("Flash patch"),
+	.bDescriptorType = USB_DTYPE_String,
+	.bString = u"Flash patch"
+};
+#endif
+
+// Far address of a string descriptor, 0 if there is none. A switch rather than a table of
+// __flash pointers, which only reach the first 64K and would break the bootloader on parts
+// whose boot section is above it. The serial number is generated and has no entry.
+static uint32_t usb_string_address(uint8_t index)
+{
+	switch (index)
+	{
+		case STRING_LANGUAGE:		return pgm_get_far_address(language_string);
+		case STRING_MANUFACTURER:	return pgm_get_far_address(manufacturer_string);
+		case STRING_PRODUCT:		return pgm_get_far_address(product_string);
+#ifdef USB_DFU_RUNTIME
+		case STRING_DFU_RUNTIME:	return pgm_get_far_address(dfu_runtime_string);
+#endif
+#ifdef USB_DFU_MODE
+		case STRING_DFU_FLASH:		return pgm_get_far_address(dfu_flash_string);
+		case STRING_DFU_EEPROM:		return pgm_get_far_address(dfu_eeprom_string);
+#endif
+#ifdef USB_DFU_PATCH
+		case STRING_DFU_PATCH:		return pgm_get_far_address(dfu_patch_string);
+#endif
+		default:					return 0;
+	}
+}
+
 
 /**************************************************************************************************
  *	Optional serial number
@@ -274,7 +754,10 @@ const __flash USB_StringDescriptor_t msft_string = {
 	.bDescriptorType = USB_DTYPE_String,
 	.bString = u"MSFT100" WCID_REQUEST_ID_STR
 };
-_Static_assert(sizeof(msft_string) <= USB_EP0_BUFFER_SIZE, "MSFT WCID string exceeds EP0 buffer size");
+
+#if (defined(USB_HID) || defined(USB_CDC) || defined(USB_MSC)) && !defined(USB_DFU_RUNTIME) && !defined(USB_COMPOSITE)
+#error USB_WCID is only needed for the DFU runtime interface with USB_HID, USB_CDC or USB_MSC
+#endif
 
 const __flash USB_MicrosoftCompatibleDescriptor_t msft_compatible = {
 	.dwLength = sizeof(USB_MicrosoftCompatibleDescriptor_t) +
@@ -285,10 +768,12 @@ const __flash USB_MicrosoftCompatibleDescriptor_t msft_compatible = {
 	.reserved = {0, 0, 0, 0, 0, 0, 0},
 	.interfaces = {
 		{
-#ifdef USB_HID
-			.bFirstInterfaceNumber = 1,		// WCID only needed for the DFU interface
+#ifdef USB_COMPOSITE
+			.bFirstInterfaceNumber = USB_COMPOSITE_WCID_INTERFACE,
+#elif defined(USB_HID) || defined(USB_CDC) || defined(USB_MSC) || defined(USB_DFU_MODE)
+			.bFirstInterfaceNumber = DFU_INTERFACE,		// WCID only needed for the DFU interface
 #else
-			.bFirstInterfaceNumber = 0,		// WCID covers both interfaces
+			.bFirstInterfaceNumber = USB_MAIN_INTERFACE,		// WCID covers both interfaces
 #endif
 			.reserved1 = 0x01,
 			.compatibleID = "WINUSB\0\0",
@@ -297,7 +782,6 @@ const __flash USB_MicrosoftCompatibleDescriptor_t msft_compatible = {
 		},
 	}
 };
-_Static_assert(sizeof(msft_compatible) <= USB_EP0_BUFFER_SIZE, "MSFT compatible descriptor exceeds EP0 buffer size");
 
 #ifdef USB_WCID_EXTENDED
 /*
@@ -327,7 +811,7 @@ const __flash USB_MicrosoftExtendedPropertiesDescriptor_t msft_extended = {
 	.wNameLength = 40,
 	.name = L"DeviceInterfaceGUID\0",
 	.dwDataLength = 78,
-	.data = L"{42314231-5A81-49F0-BC3D-A4FF138216D7}\0",
+	.data = WCID_DEVICE_INTERFACE_GUID L"\0",
 };
 #else
 // example of one extended property (WinUSB GUID) for multiple interfaces (DFU runtime)
@@ -357,7 +841,7 @@ const __flash USB_MicrosoftExtendedPropertiesDescriptor_t msft_extended = {
 	.wNameLength = 42,
 	.name = L"DeviceInterfaceGUIDs\0",
 	.dwDataLength = 80,
-	.data = L"{42314231-5A81-49F0-BC3D-A4FF138216D7}\0\0",
+	.data = WCID_DEVICE_INTERFACE_GUID L"\0\0",
 };
 #endif
 */
@@ -395,7 +879,7 @@ const __flash USB_MicrosoftExtendedPropertiesDescriptor_t msft_extended = {
 	.wNameLength = 40,
 	.name = L"DeviceInterfaceGUID\0",
 	.dwDataLength = 78,
-	.data = L"{42314231-5A81-49F0-BC3D-A4FF138216D7}\0",
+	.data = WCID_DEVICE_INTERFACE_GUID L"\0",
 
 	.dwPropLength2 = 14 + (6*2) + (13*2),
 	.dwType2 = 7,
@@ -405,9 +889,114 @@ const __flash USB_MicrosoftExtendedPropertiesDescriptor_t msft_extended = {
 	.data2 = L"Name56789AB\0",
 };
 
-_Static_assert(sizeof(msft_extended) <= USB_EP0_BUFFER_SIZE, "MSFT extended descriptor exceeds EP0 buffer size");
 #endif // USB_WCID_EXTENDED
 
+#ifdef USB_WCID_MSOS20
+// Composite devices bind WinUSB to one function, single function devices as a whole
+#ifdef USB_COMPOSITE
+#define MSOS20_FUNCTION_INTERFACE	USB_COMPOSITE_WCID_INTERFACE
+#elif defined(USB_HID) || defined(USB_CDC) || defined(USB_MSC)
+#define MSOS20_FUNCTION_INTERFACE	DFU_INTERFACE
+#endif
+
+typedef struct {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint16_t wPropertyDataType;
+	uint16_t wPropertyNameLength;
+	wchar_t PropertyName[21];
+	uint16_t wPropertyDataLength;
+	wchar_t PropertyData[40];
+} __attribute__((packed)) MSOS20InterfaceGUIDs_t;
+
+typedef struct {
+	USB_MicrosoftOS20SetHeader_t				header;
+#ifdef MSOS20_FUNCTION_INTERFACE
+	USB_MicrosoftOS20ConfigurationSubset_t		configuration;
+	USB_MicrosoftOS20FunctionSubset_t			function;
+#endif
+	USB_MicrosoftOS20CompatibleID_t				compatible_id;
+#ifdef USB_WCID_EXTENDED
+	MSOS20InterfaceGUIDs_t						interface_guids;
+#endif
+} __attribute__((packed)) MSOS20DescriptorSet_t;
+
+// Sent whole through usb_ep0_in_flash(), so it is not limited by USB_EP0_BUFFER_SIZE
+const __flash MSOS20DescriptorSet_t msos20_descriptor_set = {
+	.header = {
+		.wLength = sizeof(USB_MicrosoftOS20SetHeader_t),
+		.wDescriptorType = MSOS20_SET_HEADER_DESCRIPTOR,
+		.dwWindowsVersion = MSOS20_WINDOWS_8_1,
+		.wTotalLength = sizeof(MSOS20DescriptorSet_t),
+	},
+#ifdef MSOS20_FUNCTION_INTERFACE
+	.configuration = {
+		.wLength = sizeof(USB_MicrosoftOS20ConfigurationSubset_t),
+		.wDescriptorType = MSOS20_SUBSET_HEADER_CONFIGURATION,
+		.bConfigurationValue = 0,		// used as an index by Windows
+		.bReserved = 0,
+		.wTotalLength = sizeof(MSOS20DescriptorSet_t) - offsetof(MSOS20DescriptorSet_t, configuration),
+	},
+	.function = {
+		.wLength = sizeof(USB_MicrosoftOS20FunctionSubset_t),
+		.wDescriptorType = MSOS20_SUBSET_HEADER_FUNCTION,
+		.bFirstInterface = MSOS20_FUNCTION_INTERFACE,
+		.bReserved = 0,
+		.wSubsetLength = sizeof(MSOS20DescriptorSet_t) - offsetof(MSOS20DescriptorSet_t, function),
+	},
+#endif
+	.compatible_id = {
+		.wLength = sizeof(USB_MicrosoftOS20CompatibleID_t),
+		.wDescriptorType = MSOS20_FEATURE_COMPATIBLE_ID,
+		.CompatibleID = "WINUSB\0\0",
+		.SubCompatibleID = {0, 0, 0, 0, 0, 0, 0, 0},
+	},
+#ifdef USB_WCID_EXTENDED
+	.interface_guids = {
+		.wLength = sizeof(MSOS20InterfaceGUIDs_t),
+		.wDescriptorType = MSOS20_FEATURE_REG_PROPERTY,
+		.wPropertyDataType = 7,		// REG_MULTI_SZ
+		.wPropertyNameLength = 21*2,
+		.PropertyName = L"DeviceInterfaceGUIDs\0",
+		.wPropertyDataLength = 40*2,
+		.PropertyData = WCID_DEVICE_INTERFACE_GUID L"\0\0",
+	},
+#endif
+};
+
+typedef struct {
+	USB_BOSDescriptor_t							bos;
+	USB_USB20ExtensionDescriptor_t				usb20_extension;
+	USB_MicrosoftPlatformCapabilityDescriptor_t	msos20;
+} __attribute__((packed)) BOSDesc_t;
+
+const __flash BOSDesc_t bos_descriptor = {
+	.bos = {
+		.bLength = sizeof(USB_BOSDescriptor_t),
+		.bDescriptorType = USB_DTYPE_BOS,
+		.wTotalLength = sizeof(BOSDesc_t),
+		.bNumDeviceCaps = 2,
+	},
+	.usb20_extension = {
+		.bLength = sizeof(USB_USB20ExtensionDescriptor_t),
+		.bDescriptorType = USB_DTYPE_DeviceCapability,
+		.bDevCapabilityType = USB_DCAP_USB20Extension,
+		.bmAttributes = 0,			// no link power management
+	},
+	.msos20 = {
+		.bLength = sizeof(USB_MicrosoftPlatformCapabilityDescriptor_t),
+		.bDescriptorType = USB_DTYPE_DeviceCapability,
+		.bDevCapabilityType = USB_DCAP_Platform,
+		.bReserved = 0,
+		.PlatformCapabilityUUID = MSOS20_PLATFORM_UUID,
+		.dwWindowsVersion = MSOS20_WINDOWS_8_1,
+		.wMSOSDescriptorSetTotalLength = sizeof(MSOS20DescriptorSet_t),
+		.bMS_VendorCode = WCID_REQUEST_ID,
+		.bAltEnumCode = 0,
+	},
+};
+#endif // USB_WCID_MSOS20
+
 void handle_msft_compatible(void)
 {
 	uint32_t address = 0;
@@ -416,6 +1005,12 @@ void handle_msft_compatible(void)
 	uint8_t cmd_backup = NVM.CMD;
 	NVM.CMD = 0;
 
+#ifdef USB_WCID_MSOS20
+	if (usb_setup.wIndex == MSOS20_DESCRIPTOR_INDEX) {
+		address = pgm_get_far_address(msos20_descriptor_set);
+		size    = sizeof(MSOS20DescriptorSet_t);
+	} else
+#endif
 #ifdef USB_WCID_EXTENDED
 	if (usb_setup.wIndex == 0x0005) {
 		address = pgm_get_far_address(msft_extended);
@@ -428,14 +1023,9 @@ void handle_msft_compatible(void)
 	} else {
 		return usb_ep0_stall();
 	}
-	if (size > usb_setup.wLength) {
-		size = usb_setup.wLength;
-	}
-
-	memcpy_PF(ep0_buf_in, address, size);
 	NVM.CMD = cmd_backup;
 
-	usb_ep0_in(size);
+	usb_ep0_in_flash(address, size);
 	usb_ep0_out();
 }
 #endif // USB_WCID
@@ -458,64 +1048,66 @@ uint16_t usb_handle_descriptor_request(uint8_t type, uint8_t index) {
 			size    = sizeof(USB_DeviceDescriptor_t);
 			break;
 		case USB_DTYPE_Configuration:
+#ifdef USB_COMPOSITE
+			NVM.CMD = cmd_backup;
+			size = usb_composite_config_length();
+			usb_ep0_in_generator(usb_composite_config_read, size);
+			return size;
+#else
 			address = pgm_get_far_address(configuration_descriptor);
 			size    = sizeof(ConfigDesc_t);
 			break;
+#endif
 #ifdef USB_HID
 		case USB_DTYPE_HID:
+#ifdef USB_COMPOSITE
+			address = pgm_get_far_address(hid_function_descriptors.HIDDescriptor);
+#else
 			address = pgm_get_far_address(configuration_descriptor.HIDDescriptor);
+#endif
 			size	= sizeof(USB_HIDDescriptor_t);
 			break;
 		case USB_DTYPE_Report:
 			address = pgm_get_far_address(hid_report_descriptor);
 			size    = sizeof(hid_report_descriptor);
 			break;
+#endif
+#ifdef USB_WCID_MSOS20
+		case USB_DTYPE_BOS:
+			address = pgm_get_far_address(bos_descriptor);
+			size    = sizeof(BOSDesc_t);
+			break;
 #endif
 		case USB_DTYPE_String:
-			switch (index)
-			{
-				case 0x00:
-					address = pgm_get_far_address(language_string);
-					break;
-				case 0x01:
-					address = pgm_get_far_address(manufacturer_string);
-					break;
-				case 0x02:
-					address = pgm_get_far_address(product_string);
-					break;
 #ifdef USB_SERIAL_NUMBER
-				case 0x03:
-					generate_serial();
-					return sizeof(USB_StringDescriptor_t) + (22*2);
-#endif
-#ifdef USB_DFU_RUNTIME
-				case 0x10:
-					address = pgm_get_far_address(dfu_runtime_string);
-					break;
-#endif
-#ifdef USB_DFU_MODE
-				case 0x10:
-					address = pgm_get_far_address(dfu_flash_string);
-					break;
-				case 0x11:
-					address = pgm_get_far_address(dfu_eeprom_string);
-					break;
+			if (index == STRING_SERIAL)
+			{
+				NVM.CMD = cmd_backup;
+				generate_serial();
+				size = sizeof(USB_StringDescriptor_t) + (22*2);
+				if (size > usb_setup.wLength)
+					size = usb_setup.wLength;
+				usb_ep0_in(size);
+				return size;
+			}
 #endif
+			address = usb_string_address(index);
 #ifdef USB_WCID
-				case 0xEE:
-					address = pgm_get_far_address(msft_string);
-					break;
+			if (index == STRING_MSFT)
+				address = pgm_get_far_address(msft_string);
 #endif
-
-				default:
-					return 0;
+			if (address == 0)
+			{
+				NVM.CMD = cmd_backup;
+				return 0;
 			}
 			size = pgm_read_byte_far(address + offsetof(USB_StringDescriptor_t, bLength));
 			break;
 	}
 
-	memcpy_PF(ep0_buf_in, address, size);
 	NVM.CMD = cmd_backup;
+	if (size)
+		usb_ep0_in_flash(address, size);
 	return size;
 }
 
@@ -0,0 +1,616 @@
+/* dfu.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Device Firmware Update mode. Alternate setting 0 programs the application section and
+ * alternate setting 1 the EEPROM. Downloaded blocks are collected into a page buffer in
+ * RAM, which is handed to the NVM controller once it is full. The next page is received
+ * while the NVM erases and writes the previous one, so the host only waits when a whole
+ * page arrives before the last write has finished.
+ *
+ * A flash image ending with a DFU_ImageTrailer_t is checked with the NVM controller's
+ * range CRC in the manifest phase, and left unstarted in dfuERROR (errVERIFY) if it does
+ * not match.
+ *
+ * With USB_DFU_PATCH alternate setting 2 takes a stream of literal, fill and copy
+ * commands. Each block is copied to an input buffer and acknowledged straight away, then
+ * dfu_poll() decodes it into the page buffer while GETSTATUS reports dfuDNBUSY. Copies
+ * read the flash as it is at that point: pages before the one being decoded already hold
+ * the new image, the rest still hold the old one.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "usb.h"
+#include "usb_config.h"
+#include "usb_xmega.h"
+#include "dfu.h"
+#include "xmega.h"
+
+#ifdef USB_DFU_MODE
+
+#if defined(USB_HID) || defined(USB_CDC) || defined(USB_MSC) || defined(USB_ISOCHRONOUS) || \
+	defined(USB_COMPOSITE) || defined(USB_DFU_RUNTIME) || defined(USB_STREAM_IN) || \
+	defined(USB_STREAM_OUT) || defined(USB_DMA_IN)
+#error USB_DFU_MODE is a stand alone bootloader, undefine the other interfaces
+#endif
+
+_Static_assert((APP_SECTION_PAGE_SIZE % DFU_TRANSFER_SIZE) == 0, "DFU blocks must not straddle flash pages");
+_Static_assert((DFU_TRANSFER_SIZE % EEPROM_PAGE_SIZE) == 0, "DFU blocks must be whole EEPROM pages");
+
+static uint8_t dfu_state;
+static uint8_t dfu_status;
+static uint8_t dfu_alt;
+static uint32_t dfu_address;			// next address to download to or upload from
+
+// Page being received and the part of it waiting for the NVM. Flash is written a whole
+// buffer at a time, EEPROM one EEPROM page at a time.
+static uint8_t dfu_page[APP_SECTION_PAGE_SIZE] __attribute__((__aligned__(2)));
+static uint32_t dfu_page_address;
+static uint16_t dfu_fill;
+static uint16_t dfu_queued;				// bytes waiting to be written, from dfu_page_offset
+static uint16_t dfu_page_offset;
+
+// last write started, for bwPollTimeout
+static uint32_t dfu_write_frame;
+static uint8_t dfu_write_ms;
+
+// DFU_LOAD_MAGIC from dfu_cb_enter_dfu_mode(), saved before the C startup code initialises
+// .data and .bss over the start of SRAM
+static uint32_t dfu_load_request __attribute__((section(".noinit")));
+
+#ifdef USB_DFU_PATCH
+// Block being decoded, and the command it is part of. Commands can straddle blocks.
+static uint8_t dfu_patch_in[DFU_TRANSFER_SIZE];
+static uint16_t dfu_patch_len;
+static uint16_t dfu_patch_pos;
+static uint8_t dfu_patch_header[5];
+static uint8_t dfu_patch_got;			// header bytes received
+static uint16_t dfu_patch_count;		// output bytes left in the command
+static uint32_t dfu_patch_source;		// copy address
+#endif
+
+
+/* Size of the memory selected by the alternate setting, and its write unit
+ */
+static uint32_t dfu_memory_size(void)
+{
+	return (dfu_alt == DFU_ALT_EEPROM) ? EEPROM_SIZE : APP_SECTION_SIZE;
+}
+
+static uint16_t dfu_unit_size(void)
+{
+	return (dfu_alt == DFU_ALT_EEPROM) ? EEPROM_PAGE_SIZE : APP_SECTION_PAGE_SIZE;
+}
+
+static uint8_t dfu_unit_ms(void)
+{
+	return (dfu_alt == DFU_ALT_EEPROM) ? USB_DFU_EEPROM_WRITE_MS : USB_DFU_FLASH_WRITE_MS;
+}
+
+/* Drop any partly received or queued data. A write that has already started completes.
+ */
+static void dfu_discard(void)
+{
+	dfu_fill = 0;
+	dfu_queued = 0;
+#ifdef USB_DFU_PATCH
+	dfu_patch_len = 0;
+	dfu_patch_pos = 0;
+	dfu_patch_got = 0;
+	dfu_patch_count = 0;
+#endif
+}
+
+/* Start writing the next unit of the page buffer if the NVM is free. Called from requests
+ * and dfu_poll() with interrupts disabled.
+ */
+static void dfu_nvm_step(void)
+{
+	if ((dfu_queued == 0) || (NVM.STATUS & NVM_NVMBUSY_bm))
+		return;
+
+	uint16_t unit = dfu_unit_size();
+	uint8_t *data = &dfu_page[dfu_page_offset];
+	uint32_t address = dfu_page_address + dfu_page_offset;
+
+	if (dfu_alt == DFU_ALT_EEPROM)
+	{
+		NVM.CMD = NVM_CMD_LOAD_EEPROM_BUFFER_gc;
+		for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; i++)
+		{
+			NVM.ADDR0 = (address + i) & 0xFF;
+			NVM.ADDR1 = (address + i) >> 8;
+			NVM.ADDR2 = 0;
+			NVM.DATA0 = data[i];		// writing DATA0 loads the byte
+		}
+		NVM_erase_write_eeprom_page(address);
+	}
+	else
+	{
+		NVM_load_flash_page(data);
+		NVM_erase_write_app_page(address);
+	}
+
+	dfu_write_frame = usb_frame_counter();
+	dfu_write_ms = dfu_unit_ms();
+	dfu_page_offset += unit;
+	dfu_queued -= unit;
+	if (dfu_queued == 0)
+	{
+		// the whole buffer has been handed over, the next page can be received
+		dfu_page_address += dfu_page_offset;
+		dfu_page_offset = 0;
+		dfu_fill = 0;
+	}
+}
+
+/* Queue the page buffer for writing, padding a partial last page with erased bytes
+ */
+static void dfu_queue_page(void)
+{
+	uint16_t unit = dfu_unit_size();
+	uint16_t length = (dfu_fill + unit - 1) & ~(unit - 1);
+	memset(&dfu_page[dfu_fill], 0xFF, length - dfu_fill);
+	dfu_page_offset = 0;
+	dfu_queued = length;
+	dfu_nvm_step();
+}
+
+/* Milliseconds until the page buffer is free (all units started) or, for the manifest
+ * phase, until everything has been written
+ */
+static uint16_t dfu_busy_ms(bool until_written)
+{
+	uint16_t ms = 0;
+	if (NVM.STATUS & NVM_NVMBUSY_bm)
+	{
+		uint32_t elapsed = usb_frame_counter() - dfu_write_frame;
+		if (elapsed < dfu_write_ms)
+			ms = dfu_write_ms - elapsed;
+		else
+			ms = 1;		// slower than the datasheet figure
+	}
+
+	uint8_t units = dfu_queued / dfu_unit_size();
+	if (!until_written && units)
+		units--;		// the last unit only has to start
+	return ms + units * dfu_unit_ms();
+}
+
+/* Enter dfuERROR. The host reads the status and clears it with DFU_CLRSTATUS.
+ */
+static void dfu_error(uint8_t status)
+{
+	dfu_state = DFU_STATE_dfuERROR;
+	dfu_status = status;
+	dfu_discard();
+	usb_ep0_stall();
+}
+
+#ifdef USB_DFU_PATCH
+/* Size of a command header from its first byte
+ */
+static uint8_t dfu_patch_header_size(uint8_t cmd)
+{
+	switch (cmd & DFU_PATCH_CMD_gm)
+	{
+		case DFU_PATCH_FILL_bm:
+			return 3;
+		case DFU_PATCH_COPY_bm:
+			return 5;
+		default:
+			return 1;
+	}
+}
+
+/* True while the last block still has to be decoded
+ */
+static bool dfu_patch_pending(void)
+{
+	if (dfu_patch_pos < dfu_patch_len)
+		return true;
+	// fills and copies don't need more input
+	return (dfu_patch_count != 0) && (dfu_patch_header[0] & DFU_PATCH_FILL_bm);
+}
+
+/* Errors found while decoding are reported by the next GETSTATUS
+ */
+static void dfu_patch_error(uint8_t status)
+{
+	dfu_state = DFU_STATE_dfuERROR;
+	dfu_status = status;
+	dfu_discard();
+}
+
+/* Decode as much of the input as possible, stopping when the page buffer is waiting for
+ * the NVM or a copy needs to read flash while it is busy. Called from dfu_poll() with
+ * interrupts disabled.
+ */
+static void dfu_patch_step(void)
+{
+	if ((dfu_state != DFU_STATE_dfuDNLOAD_SYNC) && (dfu_state != DFU_STATE_dfuDNBUSY))
+		return;
+
+	while (dfu_queued == 0)
+	{
+		if (dfu_fill == APP_SECTION_PAGE_SIZE)
+		{
+			dfu_queue_page();
+			continue;
+		}
+
+		if (dfu_patch_count == 0)
+		{
+			if (dfu_patch_pos >= dfu_patch_len)
+				return;		// wait for the next block
+			dfu_patch_header[dfu_patch_got++] = dfu_patch_in[dfu_patch_pos++];
+			if (dfu_patch_got < dfu_patch_header_size(dfu_patch_header[0]))
+				continue;
+
+			dfu_patch_got = 0;
+			if ((dfu_patch_header[0] & DFU_PATCH_FILL_bm) == 0)
+				dfu_patch_count = dfu_patch_header[0] + 1;
+			else
+				dfu_patch_count = (((dfu_patch_header[0] & ~DFU_PATCH_CMD_gm) << 8) | dfu_patch_header[1]) + 1;
+			if ((dfu_patch_header[0] & DFU_PATCH_CMD_gm) == DFU_PATCH_COPY_bm)
+			{
+				dfu_patch_source = dfu_patch_header[2] | ((uint16_t)dfu_patch_header[3] << 8) |
+								   ((uint32_t)dfu_patch_header[4] << 16);
+				if (dfu_patch_source + dfu_patch_count > APP_SECTION_SIZE)
+					return dfu_patch_error(DFU_STATUS_errFILE);
+			}
+			if (dfu_address + dfu_patch_count > APP_SECTION_SIZE)
+				return dfu_patch_error(DFU_STATUS_errADDRESS);
+			continue;
+		}
+
+		uint16_t n = APP_SECTION_PAGE_SIZE - dfu_fill;
+		if (n > dfu_patch_count)
+			n = dfu_patch_count;
+		uint8_t *out = &dfu_page[dfu_fill];
+
+		switch (dfu_patch_header[0] & DFU_PATCH_CMD_gm)
+		{
+			case DFU_PATCH_FILL_bm:
+				memset(out, dfu_patch_header[2], n);
+				break;
+
+			case DFU_PATCH_COPY_bm:
+				if (NVM.STATUS & NVM_NVMBUSY_bm)
+					return;		// flash can't be read while a page is written
+				NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+				memcpy_PF(out, APP_SECTION_START + dfu_patch_source, n);
+				dfu_patch_source += n;
+				break;
+
+			default:	// literal
+				if (n > dfu_patch_len - dfu_patch_pos)
+					n = dfu_patch_len - dfu_patch_pos;
+				if (n == 0)
+					return;		// the rest is in the next block
+				memcpy(out, &dfu_patch_in[dfu_patch_pos], n);
+				dfu_patch_pos += n;
+				break;
+		}
+
+		dfu_fill += n;
+		dfu_address += n;
+		dfu_patch_count -= n;
+	}
+}
+#endif // USB_DFU_PATCH
+
+/* Check the downloaded flash image against its trailer. Called once everything has been
+ * written, returns the DFU status.
+ */
+static uint8_t dfu_verify(void)
+{
+	if (dfu_alt == DFU_ALT_EEPROM)
+		return DFU_STATUS_OK;
+
+	DFU_ImageTrailer_t trailer;
+	if (dfu_address < sizeof(trailer))
+		trailer.magic = 0;
+	else
+	{
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;		// the last write left its command behind
+		memcpy_PF(&trailer, APP_SECTION_START + dfu_address - sizeof(trailer), sizeof(trailer));
+	}
+
+	if (trailer.magic != DFU_TRAILER_MAGIC)
+	{
+#ifdef USB_DFU_REQUIRE_CRC
+		return DFU_STATUS_errFILE;
+#else
+		return DFU_STATUS_OK;
+#endif
+	}
+	if ((trailer.length == 0) || (trailer.length != dfu_address - sizeof(trailer)))
+		return DFU_STATUS_errFILE;
+
+	uint32_t crc = NVM_flash_range_crc(APP_SECTION_START, APP_SECTION_START + trailer.length - 1);
+	return (crc == trailer.crc) ? DFU_STATUS_OK : DFU_STATUS_errVERIFY;
+}
+
+/* DFU_DNLOAD, a block of up to DFU_TRANSFER_SIZE bytes in ep0_buf_out. A zero length
+ * block ends the download.
+ */
+static void dfu_download(void)
+{
+	uint16_t len = usb_setup.wLength;
+
+	if (len == 0)
+	{
+		if (dfu_state != DFU_STATE_dfuDNLOAD_IDLE)
+			return dfu_error(DFU_STATUS_errSTALLEDPKT);
+#ifdef USB_DFU_PATCH
+		if (dfu_patch_got || dfu_patch_count)
+			return dfu_error(DFU_STATUS_errFILE);		// stream ends inside a command
+#endif
+		if (dfu_fill)
+			dfu_queue_page();
+		dfu_state = DFU_STATE_dfuMANIFEST_SYNC;
+		usb_ep0_in(0);
+		return usb_ep0_out();
+	}
+
+	if (dfu_state == DFU_STATE_dfuIDLE)
+	{
+		dfu_address = 0;
+		dfu_page_address = 0;
+		dfu_discard();
+	}
+	else if (dfu_state != DFU_STATE_dfuDNLOAD_IDLE)
+		return dfu_error(DFU_STATUS_errSTALLEDPKT);
+
+	if (len > DFU_TRANSFER_SIZE)
+		return dfu_error(DFU_STATUS_errFILE);
+
+#ifdef USB_DFU_PATCH
+	if (dfu_alt == DFU_ALT_PATCH)
+	{
+		memcpy(dfu_patch_in, ep0_buf_out, len);
+		dfu_patch_len = len;
+		dfu_patch_pos = 0;
+		dfu_state = DFU_STATE_dfuDNLOAD_SYNC;
+		usb_ep0_in(0);
+		return usb_ep0_clear_out_setup();
+	}
+#endif
+
+	if (dfu_fill + len > APP_SECTION_PAGE_SIZE)
+		return dfu_error(DFU_STATUS_errFILE);		// blocks must not straddle pages
+	if (dfu_address + len > dfu_memory_size())
+		return dfu_error(DFU_STATUS_errADDRESS);
+
+	memcpy(&dfu_page[dfu_fill], ep0_buf_out, len);
+	dfu_fill += len;
+	dfu_address += len;
+	if (dfu_fill == APP_SECTION_PAGE_SIZE)
+		dfu_queue_page();
+
+	dfu_state = DFU_STATE_dfuDNLOAD_SYNC;
+	usb_ep0_in(0);
+	return usb_ep0_clear_out_setup();
+}
+
+/* Generator for EEPROM uploads, offset is from the start of the block
+ */
+static uint16_t dfu_upload_start;
+
+static void dfu_read_eeprom(uint8_t *buf, uint16_t offset, uint8_t len)
+{
+	uint16_t address = dfu_upload_start + offset;
+	while (len--)
+		*buf++ = NVM_read_eeprom_byte(address++);
+}
+
+/* DFU_UPLOAD, a block shorter than wLength ends the upload
+ */
+static void dfu_upload(void)
+{
+	if (dfu_state == DFU_STATE_dfuIDLE)
+	{
+		NVM_wait_not_busy();		// an aborted download may still be writing
+		dfu_address = 0;
+		dfu_state = DFU_STATE_dfuUPLOAD_IDLE;
+	}
+	else if (dfu_state != DFU_STATE_dfuUPLOAD_IDLE)
+		return dfu_error(DFU_STATUS_errSTALLEDPKT);
+
+	uint32_t remaining = dfu_memory_size() - dfu_address;
+	uint16_t len = usb_setup.wLength;
+	if (len > remaining)
+	{
+		len = remaining;
+		dfu_state = DFU_STATE_dfuIDLE;
+	}
+
+	uint32_t address = dfu_address;
+	dfu_address += len;
+	if (dfu_alt == DFU_ALT_EEPROM)
+	{
+		dfu_upload_start = address;
+		usb_ep0_in_generator(dfu_read_eeprom, len);
+	}
+	else
+		usb_ep0_in_flash(APP_SECTION_START + address, len);
+	return usb_ep0_out();
+}
+
+/* DFU_GETSTATUS, moves the download and manifest states on
+ */
+static void dfu_get_status(void)
+{
+	uint16_t poll_ms = 0;
+
+	switch (dfu_state)
+	{
+		case DFU_STATE_dfuDNLOAD_SYNC:
+		case DFU_STATE_dfuDNBUSY:
+			if (dfu_queued)
+			{
+				dfu_state = DFU_STATE_dfuDNBUSY;
+				poll_ms = dfu_busy_ms(false);
+			}
+#ifdef USB_DFU_PATCH
+			else if (dfu_patch_pending())
+			{
+				dfu_state = DFU_STATE_dfuDNBUSY;		// dfu_poll() is decoding
+				poll_ms = dfu_busy_ms(false) + 1;
+			}
+#endif
+			else
+				dfu_state = DFU_STATE_dfuDNLOAD_IDLE;
+			break;
+
+		case DFU_STATE_dfuMANIFEST_SYNC:
+		case DFU_STATE_dfuMANIFEST:
+			// dfu_poll() finishes the manifest phase once everything is written
+			dfu_state = DFU_STATE_dfuMANIFEST;
+			poll_ms = dfu_busy_ms(true);
+			if (dfu_alt != DFU_ALT_EEPROM)
+				poll_ms += USB_DFU_VERIFY_MS;
+			break;
+	}
+
+	uint8_t len = usb_setup.wLength;
+	if (len > sizeof(DFU_StatusResponse))
+		len = sizeof(DFU_StatusResponse);
+	DFU_StatusResponse *st = (DFU_StatusResponse *)ep0_buf_in;
+	st->bStatus = dfu_status;
+	st->bState = dfu_state;
+	st->bwPollTimeout[0] = poll_ms & 0xFF;
+	st->bwPollTimeout[1] = poll_ms >> 8;
+	st->bwPollTimeout[2] = 0;
+	st->iString = 0;
+	usb_ep0_in(len);
+	return usb_ep0_out();
+}
+
+/* DFU class requests
+ */
+void dfu_control_setup(void)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	dfu_nvm_step();
+	SREG = saved_sreg;
+
+	switch (usb_setup.bRequest)
+	{
+		case DFU_DNLOAD:
+			return dfu_download();
+
+		case DFU_UPLOAD:
+			return dfu_upload();
+
+		case DFU_GETSTATUS:
+			return dfu_get_status();
+
+		// clear an error, or abort a download or upload
+		case DFU_CLRSTATUS:
+		case DFU_ABORT:
+			dfu_discard();
+			dfu_state = DFU_STATE_dfuIDLE;
+			dfu_status = DFU_STATUS_OK;
+			usb_ep0_in(0);
+			return usb_ep0_out();
+
+		case DFU_GETSTATE:
+			ep0_buf_in[0] = dfu_state;
+			usb_ep0_in(1);
+			return usb_ep0_out();
+
+		// unsupported requests
+		default:
+			return dfu_error(DFU_STATUS_errSTALLEDPKT);
+	}
+}
+
+/* Keep the NVM busy and finish the manifest phase. Call regularly from the main loop.
+ */
+void dfu_poll(void)
+{
+	bool manifest = false;
+
+	uint8_t saved_sreg = SREG;
+	cli();
+	dfu_nvm_step();
+#ifdef USB_DFU_PATCH
+	dfu_patch_step();
+#endif
+	if ((dfu_state == DFU_STATE_dfuMANIFEST) && (dfu_queued == 0) &&
+		!(NVM.STATUS & NVM_NVMBUSY_bm))
+	{
+		dfu_status = dfu_verify();
+		if (dfu_status == DFU_STATUS_OK)
+		{
+			dfu_state = DFU_STATE_dfuMANIFEST_WAIT_RST;
+			manifest = true;
+		}
+		else
+			dfu_state = DFU_STATE_dfuERROR;		// keep the bootloader running
+	}
+	SREG = saved_sreg;
+
+	if (manifest)
+		dfu_cb_manifest();
+}
+
+/* Select flash or EEPROM, abandoning any transfer in progress
+ */
+bool dfu_set_interface(uint8_t altsetting)
+{
+	if (altsetting >= DFU_NUM_ALTS)
+		return false;
+
+	uint8_t saved_sreg = SREG;
+	cli();
+	NVM_wait_not_busy();		// the unit size changes
+	dfu_discard();
+	dfu_alt = altsetting;
+	dfu_state = DFU_STATE_dfuIDLE;
+	dfu_status = DFU_STATUS_OK;
+	SREG = saved_sreg;
+	return true;
+}
+
+uint8_t dfu_get_interface(void)
+{
+	return dfu_alt;
+}
+
+/* Runs from .init3, after the stack pointer is set up but before .data and .bss are
+ * initialised. The word is cleared so that the next reset starts the application again.
+ */
+static void __attribute__((naked, used, section(".init3"))) dfu_save_load_request(void)
+{
+	dfu_load_request = *(volatile uint32_t *)INTERNAL_SRAM_START;
+	*(volatile uint32_t *)INTERNAL_SRAM_START = 0;
+}
+
+/* Called first thing in main(). Jumps to the application, with the interrupt vectors back
+ * in the application section, unless dfu_cb_stay_in_bootloader() wants DFU mode.
+ */
+void dfu_start_application(void)
+{
+	if (dfu_cb_stay_in_bootloader(dfu_load_request == DFU_LOAD_MAGIC))
+		return;
+	CCPWrite(&PMIC.CTRL, 0);			// clears IVSEL
+	__asm__ __volatile__("jmp 0");
+}
+
+/* Called on USB reset
+ */
+void dfu_reset(void)
+{
+	dfu_discard();
+	dfu_alt = DFU_ALT_FLASH;
+	dfu_state = DFU_STATE_dfuIDLE;
+	dfu_status = DFU_STATUS_OK;
+}
+
+#endif // USB_DFU_MODE
@@ -11,7 +11,7 @@
 #define DFU_H_
 
 
-#define DFU_INTERFACE						1
+// DFU_INTERFACE is numbered in usb.h
 
 // USB descriptors
 #define	DFU_INTERFACE_CLASS					0xFE
@@ -26,6 +26,30 @@
 #define	DFU_ATTR_MANIFEST_TOLERANT_bm		(1<<2)
 #define	DFU_ATTR_WILLDETACH_bm				(1<<3)
 
+// DFU mode alternate settings
+enum {
+	DFU_ALT_FLASH						= 0,
+	DFU_ALT_EEPROM						= 1,
+#ifdef USB_DFU_PATCH
+	DFU_ALT_PATCH						= 2,
+#endif
+	DFU_NUM_ALTS
+};
+
+// Patch stream commands, a header followed by literal data. Lengths are stored minus one,
+// copy addresses are little endian and relative to the application section.
+#define DFU_PATCH_LITERAL_bm				0x00	// 0lllllll, 1 to 128 bytes follow
+#define DFU_PATCH_FILL_bm					0x80	// 10llllll llllllll value
+#define DFU_PATCH_COPY_bm					0xC0	// 11llllll llllllll address[3]
+#define DFU_PATCH_CMD_gm					0xC0
+
+// DFU mode block size, one flash page unless the control OUT buffer is smaller
+#if USB_EP0_OUT_BUFFER_SIZE < APP_SECTION_PAGE_SIZE
+#define DFU_TRANSFER_SIZE					USB_EP0_OUT_BUFFER_SIZE
+#else
+#define DFU_TRANSFER_SIZE					APP_SECTION_PAGE_SIZE
+#endif
+
 typedef struct
 {
 	uint8_t		bLength;
@@ -91,4 +115,38 @@ enum {
 };
 
 
+// Optional trailer, the last bytes of a flash image. The image is only started if the CRC
+// of the length bytes before the trailer, computed by the NVM controller, matches.
+#define DFU_TRAILER_MAGIC					0x54435243	// "CRCT"
+
+typedef struct {
+	uint32_t	length;		// bytes before the trailer, even
+	uint32_t	crc;
+	uint32_t	magic;
+} DFU_ImageTrailer_t;
+
+
+// Vendor request, device recipient, IN. wIndex:wValue is the length of the image to CRC
+// from the start of the application section, 0 for the whole section.
+#define DFU_REQUEST_CRC						0x40
+
+typedef struct {
+	uint32_t	application;
+	uint32_t	boot;
+} DFU_CRCResponse_t;
+
+
+#if defined(USB_DFU_RUNTIME) || defined(USB_DFU_MODE)
+extern void dfu_control_setup(void);
+extern void dfu_crc_setup(void);
+#endif
+#ifdef USB_DFU_MODE
+extern void dfu_start_application(void);
+extern void dfu_reset(void);
+extern void dfu_poll(void);
+extern bool dfu_set_interface(uint8_t altsetting);
+extern uint8_t dfu_get_interface(void);
+#endif
+
+
 #endif /* DFU_H_ */
\ No newline at end of file
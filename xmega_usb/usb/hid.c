@@ -2,20 +2,326 @@
  *
  * Copyright 2018 Paul Qureshi
  *
- * Human Interface Device support
+ * Human Interface Device support. Input reports are posted to a small queue per report
+ * ID and sent from the IN completion interrupt, so the application never waits for the
+ * host's polling interval and never modifies a report while it is being sent.
+ *
+ * With USB_HID_IDLE unchanged reports are dropped, and the last state is repeated from the
+ * start of frame interrupt at the idle rate set by the host.
+ *
+ * With USB_HID_LOW_LATENCY the application is called to sample its inputs just before
+ * each poll, timed from the start of frame with USB_FRAME_TIMER.
  */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include "usb.h"
 #include "usb_config.h"
+#include "hid.h"
+
+#ifdef USB_HID
+
+_Static_assert((USB_HID_QUEUE_DEPTH & (USB_HID_QUEUE_DEPTH - 1)) == 0, "USB_HID_QUEUE_DEPTH must be a power of two");
+
+#if USB_HID_REPORT_IDS > 0
+#define HID_SLOTS			USB_HID_REPORT_IDS
+#define HID_ID_SIZE			1		// reports are prefixed with their ID
+#else
+#define HID_SLOTS			1
+#define HID_ID_SIZE			0
+#endif
+
+_Static_assert(HID_ID_SIZE + USB_HID_REPORT_SIZE <= 64, "HID report exceeds endpoint size");
 
 uint8_t hid_report[USB_HID_REPORT_SIZE] __attribute__((__aligned__(2)));
 
+// Reports waiting to be sent. head and tail are free running, masked when accessing the
+// queue. Both are only changed with interrupts disabled.
+typedef struct
+{
+	uint8_t		report[USB_HID_QUEUE_DEPTH][USB_HID_REPORT_SIZE];
+	uint8_t		head;
+	uint8_t		tail;
+} hid_queue_t;
+
+static hid_queue_t hid_queue[HID_SLOTS];
+static uint8_t hid_last[HID_SLOTS][USB_HID_REPORT_SIZE];	// latest state, for GET_REPORT
+static uint8_t hid_tx_buf[HID_ID_SIZE + USB_HID_REPORT_SIZE] __attribute__((__aligned__(2)));
+static bool hid_in_busy;
+static uint8_t hid_next_slot;		// report IDs take turns
+static uint8_t hid_ep = 0x81;		// assigned by the composite framework
+
+#ifdef USB_HID_IDLE
+static uint8_t hid_idle_rate[HID_SLOTS];	// 4ms units, 0 = only send changes
+static uint16_t hid_idle_ms[HID_SLOTS];		// time since the report was last sent
+#endif
+
+#ifdef USB_HID_LOW_LATENCY
+#define HID_SAMPLE_LEAD_TICKS	((uint16_t)(USB_FRAME_TIMER_TICKS * USB_HID_SAMPLE_LEAD_US / 1000UL))
+_Static_assert(USB_HID_SAMPLE_LEAD_US < 1000, "USB_HID_SAMPLE_LEAD_US must be less than a frame");
+
+static uint8_t hid_poll_countdown;		// frames until the next poll, 0 = not known yet
+#endif
+
+
+/* Copy the next queued report to the transmit buffer and send it. Must be called with
+ * interrupts disabled.
+ */
+static void hid_send_next(void)
+{
+	for (uint8_t n = 0; n < HID_SLOTS; n++)
+	{
+		uint8_t slot = hid_next_slot;
+		if (++hid_next_slot >= HID_SLOTS)
+			hid_next_slot = 0;
+
+		hid_queue_t *q = &hid_queue[slot];
+		if (q->head != q->tail)
+		{
+#if HID_ID_SIZE
+			hid_tx_buf[0] = slot + 1;
+#endif
+			memcpy(&hid_tx_buf[HID_ID_SIZE], q->report[q->tail & (USB_HID_QUEUE_DEPTH - 1)], USB_HID_REPORT_SIZE);
+			q->tail++;
+#ifdef USB_HID_IDLE
+			hid_idle_ms[slot] = 0;
+#endif
+			usb_ep_start_in(hid_ep, hid_tx_buf, sizeof(hid_tx_buf), false);
+			hid_in_busy = true;
+			return;
+		}
+	}
+	hid_in_busy = false;
+}
+
+/* Endpoint completion callback
+ */
+static void hid_in_complete(usb_ep ep)
+{
+#ifdef USB_HID_LOW_LATENCY
+	hid_poll_countdown = USB_HID_POLL_RATE_MS;	// polled in this frame
+#endif
+	hid_send_next();
+}
+
+/* Called on USB reset with the function's interface and endpoint numbers. Reports that
+ * were waiting are sent once the host starts polling.
+ */
+void hid_reset(uint8_t first_interface, uint8_t first_endpoint)
+{
+	hid_ep = 0x80 | first_endpoint;
+#ifdef USB_HID_IDLE
+	for (uint8_t i = 0; i < HID_SLOTS; i++)
+		hid_idle_rate[i] = USB_HID_DEFAULT_IDLE;
+#endif
+#ifdef USB_HID_LOW_LATENCY
+	hid_poll_countdown = 0;
+	USB_FRAME_TIMER.INTCTRLB &= ~TC1_CCAINTLVL_gm;
+#endif
+	usb_ep_enable(hid_ep, USB_EP_TYPE_BULK_gc, 64, true);
+	usb_ep_set_callback(hid_ep, hid_in_complete);
+	hid_send_next();
+}
+
+/* Queue an input report of USB_HID_REPORT_SIZE bytes, without the report ID. report_id
+ * is 0 if the report descriptor has no report IDs. Returns false if the ID is invalid or
+ * its queue is full. With USB_HID_COALESCE a full queue never fails, the newest report
+ * that is still waiting is replaced instead. With USB_HID_IDLE a report that matches the
+ * last one posted for its ID is dropped.
+ */
+bool hid_post_report(uint8_t report_id, const uint8_t *report)
+{
+	uint8_t slot = report_id - HID_DEFAULT_ID;
+	if (slot >= HID_SLOTS)
+		return false;
+	hid_queue_t *q = &hid_queue[slot];
+
+	uint8_t saved_sreg = SREG;
+	cli();
+
+#ifdef USB_HID_IDLE
+	if (memcmp(hid_last[slot], report, USB_HID_REPORT_SIZE) == 0)
+	{
+		SREG = saved_sreg;
+		return true;		// repeated by hid_sof() if the host wants it
+	}
+#endif
+	memcpy(hid_last[slot], report, USB_HID_REPORT_SIZE);
+	if ((uint8_t)(q->head - q->tail) >= USB_HID_QUEUE_DEPTH)
+	{
+#ifdef USB_HID_COALESCE
+		memcpy(q->report[(q->head - 1) & (USB_HID_QUEUE_DEPTH - 1)], report, USB_HID_REPORT_SIZE);
+#else
+		SREG = saved_sreg;
+		return false;
+#endif
+	}
+	else
+	{
+		memcpy(q->report[q->head & (USB_HID_QUEUE_DEPTH - 1)], report, USB_HID_REPORT_SIZE);
+		q->head++;
+	}
+
+	if (!hid_in_busy)
+		hid_send_next();
+
+	SREG = saved_sreg;
+	return true;
+}
+
+/* Copy the latest state of an input report, including its ID if report IDs are used, for
+ * GET_REPORT. Returns the length or -1 if the ID is invalid.
+ */
+int16_t hid_get_last_report(uint8_t report_id, uint8_t *buffer)
+{
+	uint8_t slot = report_id - HID_DEFAULT_ID;
+	if (slot >= HID_SLOTS)
+		return -1;
+
+#if HID_ID_SIZE
+	*buffer++ = report_id;
+#endif
+	uint8_t saved_sreg = SREG;
+	cli();
+	memcpy(buffer, hid_last[slot], USB_HID_REPORT_SIZE);
+	SREG = saved_sreg;
+	return HID_ID_SIZE + USB_HID_REPORT_SIZE;
+}
+
+#ifdef USB_HID_IDLE
+/* Repeat the last state of each report whose idle period has expired, unless a newer
+ * report is already waiting.
+ */
+static void hid_idle_sof(void)
+{
+	for (uint8_t slot = 0; slot < HID_SLOTS; slot++)
+	{
+		if (hid_idle_rate[slot] == 0)
+			continue;
+		if (++hid_idle_ms[slot] < (uint16_t)hid_idle_rate[slot] * 4)
+			continue;
+
+		hid_idle_ms[slot] = 0;
+		hid_queue_t *q = &hid_queue[slot];
+		if (q->head == q->tail)
+		{
+			memcpy(q->report[q->head & (USB_HID_QUEUE_DEPTH - 1)], hid_last[slot], USB_HID_REPORT_SIZE);
+			q->head++;
+		}
+	}
+}
+
+/* SET_IDLE, rate is in 4ms units. Report ID 0 sets all reports.
+ */
+bool hid_set_idle(uint8_t report_id, uint8_t rate)
+{
+	uint8_t first = 0;
+	uint8_t last = HID_SLOTS - 1;
+	if (report_id != 0)
+	{
+		first = last = report_id - HID_DEFAULT_ID;
+		if (first >= HID_SLOTS)
+			return false;
+	}
+
+	uint8_t saved_sreg = SREG;
+	cli();
+	for (uint8_t slot = first; slot <= last; slot++)
+	{
+		hid_idle_rate[slot] = rate;
+		hid_idle_ms[slot] = 0;
+	}
+	SREG = saved_sreg;
+	return true;
+}
+
+/* GET_IDLE, returns -1 if the report ID is invalid
+ */
+int16_t hid_get_idle(uint8_t report_id)
+{
+	uint8_t slot = 0;
+	if (report_id != 0)
+	{
+		slot = report_id - HID_DEFAULT_ID;
+		if (slot >= HID_SLOTS)
+			return -1;
+	}
+	return hid_idle_rate[slot];
+}
+#endif // USB_HID_IDLE
 
-/* Send HID reports. Blocks until the endpoint is ready.
+#ifdef USB_HID_LOW_LATENCY
+/* Arm the sample timer in the frame before each poll. The host polls at the same point
+ * of every USB_HID_POLL_RATE_MS frames, usually just after the SOF, so the countdown is
+ * restarted by each completed transfer. Until the first one every frame is sampled.
+ */
+static void hid_sample_sof(void)
+{
+	if (hid_poll_countdown != 0)
+	{
+		if (--hid_poll_countdown == 0)
+			hid_poll_countdown = USB_HID_POLL_RATE_MS;
+		if (hid_poll_countdown != 1)
+			return;
+	}
+
+	usb_timestamp_t ts;
+	usb_frame_timestamp(&ts);
+	USB_FRAME_TIMER.CCA = USB_FRAME_TIMER.CNT - ts.ticks + (USB_FRAME_TIMER_TICKS - HID_SAMPLE_LEAD_TICKS);
+	USB_FRAME_TIMER.INTFLAGS = TC1_CCAIF_bm;
+	USB_FRAME_TIMER.INTCTRLB = (USB_FRAME_TIMER.INTCTRLB & ~TC1_CCAINTLVL_gm) | TC_CCAINTLVL_MED_gc;
+}
+
+/* Sample timer, one shot. Same interrupt level as USB so it can't interrupt the queue
+ * handling in the completion callback.
+ */
+ISR(USB_FRAME_TIMER_CCA_vect)
+{
+	USB_FRAME_TIMER.INTCTRLB &= ~TC1_CCAINTLVL_gm;
+
+	uint8_t report[USB_HID_REPORT_SIZE];
+	hid_cb_sample(report);
+
+	// reports still waiting are older than the sample, it replaces them
+	hid_queue_t *q = &hid_queue[0];
+	if (q->head != q->tail)
+	{
+		q->tail = q->head - 1;
+		memcpy(q->report[q->tail & (USB_HID_QUEUE_DEPTH - 1)], report, USB_HID_REPORT_SIZE);
+		memcpy(hid_last[0], report, USB_HID_REPORT_SIZE);
+		return;
+	}
+	hid_post_report(HID_DEFAULT_ID, report);
+}
+#endif // USB_HID_LOW_LATENCY
+
+#ifdef USB_HID_SOF
+/* Called from the start of frame interrupt
+ */
+void hid_sof(void)
+{
+#ifdef USB_HID_IDLE
+	hid_idle_sof();
+	if (!hid_in_busy)
+		hid_send_next();
+#endif
+#ifdef USB_HID_LOW_LATENCY
+	hid_sample_sof();
+#endif
+}
+#endif
+
+/* Send hid_report with the default report ID. Only blocks while the queue is full, and
+ * keeps handling deferred control requests meanwhile so the host can configure the device.
  */
 void hid_send_report(void)
 {
-	while (!usb_ep_is_ready(0x81));
-	usb_ep_start_in(0x81, hid_report, USB_HID_REPORT_SIZE, false);
+	while (!hid_post_report(HID_DEFAULT_ID, hid_report))
+	{
+#ifdef USB_DEFERRED_CONTROL
+		usb_poll();
+#endif
+	}
 }
+
+#endif // USB_HID
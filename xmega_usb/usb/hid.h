@@ -9,10 +9,28 @@
 #define HID_H_
 
 
+// First report ID, 0 if the report descriptor has no report IDs
+#if USB_HID_REPORT_IDS > 0
+#define HID_DEFAULT_ID		1
+#else
+#define HID_DEFAULT_ID		0
+#endif
+
 extern uint8_t hid_report[USB_HID_REPORT_SIZE];
 
 
 extern void hid_send_report(void);
+extern bool hid_post_report(uint8_t report_id, const uint8_t *report);
+extern int16_t hid_get_last_report(uint8_t report_id, uint8_t *buffer);
+extern void hid_control_setup(void);
+extern void hid_reset(uint8_t first_interface, uint8_t first_endpoint);
+#if defined(USB_HID_IDLE) || defined(USB_HID_LOW_LATENCY)
+extern void hid_sof(void);
+#endif
+#ifdef USB_HID_IDLE
+extern bool hid_set_idle(uint8_t report_id, uint8_t rate);
+extern int16_t hid_get_idle(uint8_t report_id);
+#endif
 
 
-#endif /* HID_H_ */
\ No newline at end of file
+#endif /* HID_H_ */
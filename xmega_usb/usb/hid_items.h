@@ -0,0 +1,46 @@
+/* hid_items.h
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * HID report descriptor items. Input report fields are listed once with
+ * HID_INPUT_FIELDS(X), which generates both the descriptor items and the report size.
+ */
+
+#ifndef HID_ITEMS_H_
+#define HID_ITEMS_H_
+
+
+// Short items with one byte of data
+#define HID_USAGE_PAGE(x)			0x05, (uint8_t)(x)
+#define HID_USAGE(x)				0x09, (uint8_t)(x)
+#define HID_USAGE_MINIMUM(x)		0x19, (uint8_t)(x)
+#define HID_USAGE_MAXIMUM(x)		0x29, (uint8_t)(x)
+#define HID_LOGICAL_MINIMUM(x)		0x15, (uint8_t)(x)
+#define HID_LOGICAL_MAXIMUM(x)		0x25, (uint8_t)(x)
+#define HID_REPORT_SIZE(x)			0x75, (uint8_t)(x)
+#define HID_REPORT_COUNT(x)			0x95, (uint8_t)(x)
+#define HID_COLLECTION(x)			0xA1, (uint8_t)(x)
+#define HID_END_COLLECTION			0xC0
+#define HID_INPUT(x)				0x81, (uint8_t)(x)
+
+// Main item flags
+#define HID_DATA_VAR_ABS			0x02
+#define HID_CONST_VAR_ABS			0x03
+#define HID_DATA_VAR_REL			0x06
+
+// Collection types
+#define HID_COLLECTION_PHYSICAL		0x00
+#define HID_COLLECTION_APPLICATION	0x01
+
+
+// Each entry of HID_INPUT_FIELDS is X(report size, report count, input flags, items...),
+// where items are the usage and logical range items that precede the INPUT item.
+#define HID_INPUT_FIELD_ITEMS(size, count, flags, ...) \
+	__VA_ARGS__, HID_REPORT_SIZE(size), HID_REPORT_COUNT(count), HID_INPUT(flags),
+#define HID_INPUT_FIELD_BITS(size, count, flags, ...)	+ ((size) * (count))
+
+// Input report size in bytes, fields are packed without padding
+#define HID_INPUT_REPORT_SIZE(fields)	(((0 fields(HID_INPUT_FIELD_BITS)) + 7) / 8)
+
+
+#endif /* HID_ITEMS_H_ */
@@ -0,0 +1,408 @@
+/* msc.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Mass Storage Class, bulk-only transport with the SCSI transparent command set. Blocks
+ * are read and written by the msc_cb_*_block() backend in usb_config.h, from msc_poll()
+ * in the main loop.
+ *
+ * Both bulk endpoints are ping-pong and multi-packet, with one block per bank. While the
+ * host transfers one block, the backend reads the next one into, or writes the previous
+ * one from, the other buffer.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+#include "usb.h"
+#include "usb_config.h"
+#include "usb_xmega.h"
+#include "msc.h"
+
+#ifdef USB_MSC
+
+#if defined(USB_HID) || defined(USB_CDC) || defined(USB_STREAM_IN) || defined(USB_STREAM_OUT) || defined(USB_DMA_IN)
+#error USB_MSC needs the vendor bulk endpoints, undefine USB_HID, USB_CDC, USB_STREAM_IN, USB_STREAM_OUT and USB_DMA_IN
+#endif
+_Static_assert(((MSC_BLOCK_SIZE % 64) == 0) && (MSC_BLOCK_SIZE <= 960), "MSC_BLOCK_SIZE must be a multiple of 64, at most 960");
+
+#define MSC_PACKET_SIZE		64
+
+enum {
+	MSC_STATE_IDLE,			// endpoints not set up yet
+	MSC_STATE_CBW,			// waiting for a command
+	MSC_STATE_DATA_IN,
+	MSC_STATE_DATA_OUT,
+	MSC_STATE_CSW,			// waiting for the host to collect the status
+	MSC_STATE_STALLED,		// invalid command, waiting for reset recovery
+};
+
+static volatile uint8_t msc_state;		// also read by CLEAR_FEATURE(ENDPOINT_HALT)
+static volatile bool msc_reset_pending;
+
+// The hardware writes whole packets, so the CBW buffer is one packet long
+static union {
+	MSC_CommandBlockWrapper_t	cbw;
+	uint8_t						packet[MSC_PACKET_SIZE];
+} msc_cbw __attribute__((__aligned__(2)));
+static MSC_CommandStatusWrapper_t msc_csw __attribute__((__aligned__(2)));
+
+static uint8_t msc_buf[2][MSC_BLOCK_SIZE] __attribute__((__aligned__(2)));
+static uint8_t msc_buf_busy;			// bit per buffer queued on an endpoint
+
+// READ(10)/WRITE(10) in progress
+static uint32_t msc_lba;				// next block for the backend
+static uint16_t msc_blocks_pending;		// blocks not yet read from the backend / queued for the host
+static bool msc_error;
+
+static uint8_t msc_sense_key;
+static uint8_t msc_sense_asc;
+
+
+/* SCSI fields are big endian
+ */
+static uint32_t msc_get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint16_t)p[2] << 8) | p[3];
+}
+
+static void msc_put_be32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+/* Copy an INQUIRY string, padded with spaces
+ */
+static void msc_copy_padded(uint8_t *dest, const char *src, uint8_t len)
+{
+	while (len--)
+		*dest++ = *src ? *src++ : ' ';
+}
+
+/* Index of a buffer that isn't queued on an endpoint, or -1
+ */
+static int8_t msc_free_buffer(void)
+{
+	if (!(msc_buf_busy & 1))
+		return 0;
+	if (!(msc_buf_busy & 2))
+		return 1;
+	return -1;
+}
+
+/* Wait for the next command
+ */
+static void msc_queue_cbw(void)
+{
+	msc_state = MSC_STATE_CBW;
+	usb_ep_queue_out(MSC_OUT_EP, msc_cbw.packet, sizeof(msc_cbw.packet));
+}
+
+/* Send the status for the current command. dCSWDataResidue is kept up to date as data
+ * is transferred.
+ */
+static void msc_send_csw(uint8_t status)
+{
+	msc_csw.dCSWSignature = MSC_CSW_SIGNATURE;
+	msc_csw.dCSWTag = msc_cbw.cbw.dCBWTag;
+	msc_csw.bCSWStatus = status;
+	msc_state = MSC_STATE_CSW;
+	usb_ep_queue_in(MSC_IN_EP, (uint8_t *)&msc_csw, sizeof(msc_csw), false);
+}
+
+/* End a command without (any more) data. If the host expects more data, the data
+ * endpoint is stalled so that it moves on to the status stage.
+ */
+static void msc_no_data(uint8_t status)
+{
+	if (msc_csw.dCSWDataResidue)
+	{
+		if (msc_cbw.cbw.bmCBWFlags & MSC_CBW_FLAG_IN_bm)
+			usb_ep_set_stall(MSC_IN_EP);
+		else
+			usb_ep_set_stall(MSC_OUT_EP);
+	}
+	msc_send_csw(status);
+}
+
+/* Fail the command, the host reads the reason with REQUEST SENSE
+ */
+static void msc_fail(uint8_t sense_key, uint8_t asc)
+{
+	msc_sense_key = sense_key;
+	msc_sense_asc = asc;
+	msc_no_data(MSC_CSW_STATUS_FAILED);
+}
+
+/* Send len bytes of response from msc_buf[0]. The response is cut short if the host
+ * asked for less.
+ */
+static void msc_send_response(uint16_t len)
+{
+	if (!(msc_cbw.cbw.bmCBWFlags & MSC_CBW_FLAG_IN_bm))
+		return msc_fail(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB);
+
+	if (len > msc_csw.dCSWDataResidue)
+		len = msc_csw.dCSWDataResidue;
+	if (len == 0)
+		return msc_no_data(MSC_CSW_STATUS_PASSED);
+
+	msc_csw.dCSWDataResidue -= len;
+	msc_blocks_pending = 0;
+	msc_buf_busy = 1;
+	msc_state = MSC_STATE_DATA_IN;
+	usb_ep_queue_in(MSC_IN_EP, msc_buf[0], len, msc_csw.dCSWDataResidue != 0);
+}
+
+/* Queue free buffers to receive blocks from the host
+ */
+static void msc_queue_write_buffers(void)
+{
+	int8_t i;
+	while (msc_blocks_pending && ((i = msc_free_buffer()) >= 0))
+	{
+		usb_ep_queue_out(MSC_OUT_EP, msc_buf[i], MSC_BLOCK_SIZE);
+		msc_buf_busy |= 1 << i;
+		msc_blocks_pending--;
+	}
+}
+
+/* Start READ(10) or WRITE(10). Reads are started by msc_poll().
+ */
+static void msc_start_transfer(void)
+{
+	const uint8_t *cb = msc_cbw.cbw.CBWCB;
+	bool write = (cb[0] == SCSI_WRITE_10);
+	uint32_t lba = msc_get_be32(&cb[2]);
+	uint16_t blocks = ((uint16_t)cb[7] << 8) | cb[8];
+
+	if ((lba + blocks > msc_cb_block_count()) || (lba + blocks < lba))
+		return msc_fail(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_LBA_OUT_OF_RANGE);
+
+	// host and device must agree on the amount and direction of data
+	if (((uint32_t)blocks * MSC_BLOCK_SIZE != msc_csw.dCSWDataResidue) ||
+		(blocks && (write == ((msc_cbw.cbw.bmCBWFlags & MSC_CBW_FLAG_IN_bm) != 0))))
+		return msc_no_data(MSC_CSW_STATUS_PHASE_ERROR);
+
+	if (write && msc_cb_write_protected())
+		return msc_fail(SCSI_SENSE_DATA_PROTECT, SCSI_ASC_WRITE_PROTECTED);
+
+	if (blocks == 0)
+		return msc_send_csw(MSC_CSW_STATUS_PASSED);
+
+	msc_lba = lba;
+	msc_blocks_pending = blocks;
+	msc_buf_busy = 0;
+	msc_error = false;
+	if (write)
+	{
+		msc_state = MSC_STATE_DATA_OUT;
+		msc_queue_write_buffers();
+	}
+	else
+		msc_state = MSC_STATE_DATA_IN;
+}
+
+/* Handle a SCSI command
+ */
+static void msc_handle_command(void)
+{
+	const uint8_t *cb = msc_cbw.cbw.CBWCB;
+	uint8_t *response = msc_buf[0];
+	msc_csw.dCSWDataResidue = msc_cbw.cbw.dCBWDataTransferLength;
+
+	switch (cb[0])
+	{
+		case SCSI_TEST_UNIT_READY:
+		case SCSI_PREVENT_ALLOW_MEDIUM_REMOVAL:
+		case SCSI_START_STOP_UNIT:
+		case SCSI_VERIFY_10:
+		case SCSI_SYNCHRONIZE_CACHE_10:
+			return msc_no_data(MSC_CSW_STATUS_PASSED);
+
+		case SCSI_INQUIRY:
+			memset(response, 0, 36);
+			response[0] = 0x00;					// direct access block device
+			response[1] = 0x80;					// removable
+			response[2] = 0x04;					// SPC-2
+			response[3] = 0x02;					// response data format
+			response[4] = 36 - 5;				// additional length
+			msc_copy_padded(&response[8], MSC_INQUIRY_VENDOR, 8);
+			msc_copy_padded(&response[16], MSC_INQUIRY_PRODUCT, 16);
+			msc_copy_padded(&response[32], MSC_INQUIRY_REVISION, 4);
+			return msc_send_response(36);
+
+		case SCSI_REQUEST_SENSE:
+			memset(response, 0, 18);
+			response[0] = 0x70;					// current error, fixed format
+			response[2] = msc_sense_key;
+			response[7] = 18 - 8;				// additional length
+			response[12] = msc_sense_asc;
+			msc_sense_key = SCSI_SENSE_NO_SENSE;
+			msc_sense_asc = SCSI_ASC_NONE;
+			return msc_send_response(18);
+
+		case SCSI_READ_CAPACITY_10:
+			msc_put_be32(&response[0], msc_cb_block_count() - 1);	// last block
+			msc_put_be32(&response[4], MSC_BLOCK_SIZE);
+			return msc_send_response(8);
+
+		case SCSI_READ_FORMAT_CAPACITIES:
+			memset(response, 0, 12);
+			response[3] = 8;					// capacity list length
+			msc_put_be32(&response[4], msc_cb_block_count());
+			response[8] = 0x02;					// formatted media
+			response[10] = MSC_BLOCK_SIZE >> 8;
+			response[11] = MSC_BLOCK_SIZE & 0xFF;
+			return msc_send_response(12);
+
+		case SCSI_MODE_SENSE_6:
+			response[0] = 3;					// mode data length
+			response[1] = 0;					// medium type
+			response[2] = msc_cb_write_protected() ? 0x80 : 0;
+			response[3] = 0;					// no block descriptors
+			return msc_send_response(4);
+
+		case SCSI_READ_10:
+		case SCSI_WRITE_10:
+			return msc_start_transfer();
+
+		default:
+			return msc_fail(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_COMMAND);
+	}
+}
+
+/* Called on USB reset
+ */
+void msc_reset(void)
+{
+	msc_reset_pending = true;
+}
+
+/* Handle class requests for the mass storage interface
+ */
+void msc_control_setup(void)
+{
+	switch (usb_setup.bRequest)
+	{
+		case MSC_REQ_BOT_RESET:
+			msc_reset_pending = true;
+			usb_ep0_in(0);
+			return usb_ep0_out();
+
+		case MSC_REQ_GET_MAX_LUN:
+			ep0_buf_in[0] = 0;		// one logical unit
+			usb_ep0_in(1);
+			return usb_ep0_out();
+
+		default:
+			return usb_ep0_stall();
+	}
+}
+
+/* Called for CLEAR_FEATURE(ENDPOINT_HALT) on the bulk endpoints. After an invalid CBW
+ * both stay halted until reset recovery (BOT 6.6.1), i.e. until the mass storage reset.
+ */
+bool msc_clear_halt_allowed(void)
+{
+	return (msc_state != MSC_STATE_STALLED) || msc_reset_pending;
+}
+
+/* Run the bulk-only transport. Call regularly from the main loop, block device access
+ * happens here.
+ */
+void msc_poll(void)
+{
+	uint8_t *buf;
+	usb_size len;
+
+	if (msc_reset_pending)
+	{
+		msc_reset_pending = false;
+		usb_ep_enable(MSC_IN_EP, USB_EP_TYPE_BULK_gc | USB_EP_PINGPONG_bm | USB_EP_MULTIPKT_bm, MSC_PACKET_SIZE, false);
+		usb_ep_enable(MSC_OUT_EP, USB_EP_TYPE_BULK_gc | USB_EP_PINGPONG_bm | USB_EP_MULTIPKT_bm, MSC_PACKET_SIZE, false);
+		msc_buf_busy = 0;
+		msc_queue_cbw();
+		return;
+	}
+
+	switch (msc_state)
+	{
+		case MSC_STATE_CBW:
+			if (!usb_ep_dequeue(MSC_OUT_EP, NULL, &len))
+				return;
+			if ((len != sizeof(MSC_CommandBlockWrapper_t)) ||
+				(msc_cbw.cbw.dCBWSignature != MSC_CBW_SIGNATURE) ||
+				(msc_cbw.cbw.bCBWLUN != 0))
+			{
+				// invalid CBW, stall until the host does reset recovery
+				usb_ep_set_stall(MSC_IN_EP);
+				usb_ep_set_stall(MSC_OUT_EP);
+				msc_state = MSC_STATE_STALLED;
+				return;
+			}
+			return msc_handle_command();
+
+		case MSC_STATE_DATA_IN:
+			while (usb_ep_dequeue(MSC_IN_EP, &buf, NULL))
+				msc_buf_busy &= ~(1 << (buf == msc_buf[1]));
+
+			// read ahead into any free buffers
+			int8_t i;
+			while (msc_blocks_pending && ((i = msc_free_buffer()) >= 0))
+			{
+				if (!msc_cb_read_block(msc_lba, msc_buf[i]))
+				{
+					msc_sense_key = SCSI_SENSE_MEDIUM_ERROR;
+					msc_sense_asc = SCSI_ASC_UNRECOVERED_READ_ERROR;
+					msc_error = true;
+					msc_blocks_pending = 0;
+					break;
+				}
+				msc_lba++;
+				msc_blocks_pending--;
+				msc_csw.dCSWDataResidue -= MSC_BLOCK_SIZE;
+				msc_buf_busy |= 1 << i;
+				usb_ep_queue_in(MSC_IN_EP, msc_buf[i], MSC_BLOCK_SIZE, false);
+			}
+
+			if (msc_buf_busy == 0)
+				msc_no_data(msc_error ? MSC_CSW_STATUS_FAILED : MSC_CSW_STATUS_PASSED);
+			return;
+
+		case MSC_STATE_DATA_OUT:
+			while (usb_ep_dequeue(MSC_OUT_EP, &buf, &len))
+			{
+				msc_buf_busy &= ~(1 << (buf == msc_buf[1]));
+				msc_csw.dCSWDataResidue -= len;
+				if (len != MSC_BLOCK_SIZE)
+				{
+					// host ended the data early, stop receiving
+					msc_error = true;
+					msc_blocks_pending = 0;
+				}
+				if (!msc_error && !msc_cb_write_block(msc_lba, buf))
+				{
+					msc_sense_key = SCSI_SENSE_MEDIUM_ERROR;
+					msc_sense_asc = SCSI_ASC_WRITE_FAULT;
+					msc_error = true;
+				}
+				msc_lba++;
+				msc_queue_write_buffers();
+			}
+
+			if ((msc_buf_busy == 0) && (msc_blocks_pending == 0))
+				msc_no_data(msc_error ? MSC_CSW_STATUS_FAILED : MSC_CSW_STATUS_PASSED);
+			return;
+
+		case MSC_STATE_CSW:
+			if (usb_ep_dequeue(MSC_IN_EP, NULL, NULL))
+				msc_queue_cbw();
+			return;
+	}
+}
+
+#endif // USB_MSC
@@ -0,0 +1,90 @@
+/* msc.h
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Mass Storage Class, bulk-only transport with the SCSI transparent command set
+ */
+
+#ifndef MSC_H_
+#define MSC_H_
+
+
+// MSC_INTERFACE is numbered in usb.h
+#define MSC_IN_EP							USB_MAIN_IN_EP
+#define MSC_OUT_EP							USB_MAIN_OUT_EP
+
+// USB descriptors
+#define MSC_INTERFACE_CLASS					0x08
+#define MSC_INTERFACE_SUBCLASS_SCSI			0x06
+#define MSC_INTERFACE_PROTOCOL_BOT			0x50
+
+// MSC requests
+#define MSC_REQ_GET_MAX_LUN					0xFE
+#define MSC_REQ_BOT_RESET					0xFF
+
+// Bulk-only transport
+#define MSC_CBW_SIGNATURE					0x43425355		// "USBC"
+#define MSC_CSW_SIGNATURE					0x53425355		// "USBS"
+#define MSC_CBW_FLAG_IN_bm					0x80
+
+typedef struct
+{
+	uint32_t	dCBWSignature;
+	uint32_t	dCBWTag;
+	uint32_t	dCBWDataTransferLength;
+	uint8_t		bmCBWFlags;
+	uint8_t		bCBWLUN;
+	uint8_t		bCBWCBLength;
+	uint8_t		CBWCB[16];
+} __attribute__ ((packed)) MSC_CommandBlockWrapper_t;
+
+typedef struct
+{
+	uint32_t	dCSWSignature;
+	uint32_t	dCSWTag;
+	uint32_t	dCSWDataResidue;
+	uint8_t		bCSWStatus;
+} __attribute__ ((packed)) MSC_CommandStatusWrapper_t;
+
+#define MSC_CSW_STATUS_PASSED				0x00
+#define MSC_CSW_STATUS_FAILED				0x01
+#define MSC_CSW_STATUS_PHASE_ERROR			0x02
+
+// SCSI commands
+#define SCSI_TEST_UNIT_READY				0x00
+#define SCSI_REQUEST_SENSE					0x03
+#define SCSI_INQUIRY						0x12
+#define SCSI_MODE_SENSE_6					0x1A
+#define SCSI_START_STOP_UNIT				0x1B
+#define SCSI_PREVENT_ALLOW_MEDIUM_REMOVAL	0x1E
+#define SCSI_READ_FORMAT_CAPACITIES			0x23
+#define SCSI_READ_CAPACITY_10				0x25
+#define SCSI_READ_10						0x28
+#define SCSI_WRITE_10						0x2A
+#define SCSI_VERIFY_10						0x2F
+#define SCSI_SYNCHRONIZE_CACHE_10			0x35
+
+// SCSI sense keys and additional sense codes
+#define SCSI_SENSE_NO_SENSE					0x00
+#define SCSI_SENSE_MEDIUM_ERROR				0x03
+#define SCSI_SENSE_ILLEGAL_REQUEST			0x05
+#define SCSI_SENSE_DATA_PROTECT				0x07
+
+#define SCSI_ASC_NONE						0x00
+#define SCSI_ASC_WRITE_FAULT				0x03
+#define SCSI_ASC_UNRECOVERED_READ_ERROR		0x11
+#define SCSI_ASC_INVALID_COMMAND			0x20
+#define SCSI_ASC_LBA_OUT_OF_RANGE			0x21
+#define SCSI_ASC_INVALID_FIELD_IN_CDB		0x24
+#define SCSI_ASC_WRITE_PROTECTED			0x27
+
+
+#ifdef USB_MSC
+extern void	msc_reset(void);
+extern void	msc_control_setup(void);
+extern bool	msc_clear_halt_allowed(void);
+extern void	msc_poll(void);
+#endif
+
+
+#endif /* MSC_H_ */
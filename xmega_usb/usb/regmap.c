@@ -0,0 +1,144 @@
+/* regmap.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Vendor control register map. Registers are variables listed in regmap_table in
+ * usb_config.h, addressed by their position in the table. A read or write starting at
+ * wValue covers as many consecutive registers as fit in wLength, so the host can fetch
+ * a whole block of settings with one control transfer.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+#include "regmap.h"
+#define REGMAP_DECLARE_TABLE
+#include "usb.h"
+#include "usb_config.h"
+#include "usb_xmega.h"
+#undef REGMAP_DECLARE_TABLE
+
+#ifdef USB_REGMAP
+
+#define REGMAP_COUNT	(sizeof(regmap_table) / sizeof(regmap_entry_t))
+
+
+/* Copy a register with interrupts disabled, so that multi-byte values written by
+ * interrupt handlers are never torn.
+ */
+static void regmap_copy(void *dest, const void *src, uint8_t size)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	memcpy(dest, src, size);
+	SREG = saved_sreg;
+}
+
+/* Read registers starting at wValue, until the next one doesn't fit in wLength
+ */
+static void regmap_read(void)
+{
+	uint16_t reg = usb_setup.wValue;
+	uint16_t limit = usb_setup.wLength;
+	if (limit > USB_EP0_BUFFER_SIZE)
+		limit = USB_EP0_BUFFER_SIZE;
+
+	if (reg >= REGMAP_COUNT)
+		return usb_ep0_stall();
+
+	uint8_t size = 0;
+	while (reg < REGMAP_COUNT)
+	{
+		uint8_t len = regmap_table[reg].type & REGMAP_TYPE_SIZE_gm;
+		if (size + len > limit)
+			break;
+		regmap_copy(&ep0_buf_in[size], regmap_table[reg].address, len);
+		size += len;
+		reg++;
+	}
+
+	usb_ep0_in(size);
+	usb_ep0_out();
+}
+
+/* Write registers starting at wValue. The data must cover whole, writable registers.
+ * Nothing is written unless the whole request is valid.
+ */
+static void regmap_write(void)
+{
+	uint16_t reg = usb_setup.wValue;
+	uint16_t size = 0;
+
+	while (size < usb_setup.wLength)
+	{
+		if ((reg >= REGMAP_COUNT) || (regmap_table[reg].flags & REGMAP_FLAG_READONLY_bm))
+			return usb_ep0_stall();
+		size += regmap_table[reg].type & REGMAP_TYPE_SIZE_gm;
+		reg++;
+	}
+	if (size != usb_setup.wLength)
+		return usb_ep0_stall();
+
+	size = 0;
+	for (reg = usb_setup.wValue; size < usb_setup.wLength; reg++)
+	{
+		uint8_t len = regmap_table[reg].type & REGMAP_TYPE_SIZE_gm;
+		regmap_copy(regmap_table[reg].address, &ep0_buf_out[size], len);
+		size += len;
+	}
+	regmap_cb_written(usb_setup.wValue, reg - usb_setup.wValue);
+
+	usb_ep0_in(0);
+	usb_ep0_clear_out_setup();
+}
+
+/* Describe one register
+ */
+static void regmap_info(void)
+{
+	uint16_t reg = usb_setup.wValue;
+	if (reg >= REGMAP_COUNT)
+		return usb_ep0_stall();
+
+	regmap_info_t *info = (regmap_info_t *)ep0_buf_in;
+	info->count = REGMAP_COUNT;
+	info->type = regmap_table[reg].type;
+	info->flags = regmap_table[reg].flags;
+	for (uint8_t i = 0; i < REGMAP_NAME_LENGTH; i++)
+		info->name[i] = regmap_table[reg].name[i];
+
+	uint8_t size = sizeof(regmap_info_t);
+	if (size > usb_setup.wLength)
+		size = usb_setup.wLength;
+	usb_ep0_in(size);
+	usb_ep0_out();
+}
+
+/* Handle register map vendor requests
+ */
+void regmap_control_setup(void)
+{
+	bool in = (usb_setup.bmRequestType & 0x80) != 0;
+
+	switch (usb_setup.bRequest)
+	{
+		case REGMAP_REQUEST_READ:
+			if (in)
+				return regmap_read();
+			break;
+
+		case REGMAP_REQUEST_WRITE:
+			if (!in)
+				return regmap_write();
+			break;
+
+		case REGMAP_REQUEST_INFO:
+			if (in)
+				return regmap_info();
+			break;
+	}
+
+	usb_ep0_stall();
+}
+
+#endif // USB_REGMAP
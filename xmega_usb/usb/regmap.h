@@ -0,0 +1,58 @@
+/* regmap.h
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Vendor control register map, typed parameters read and written by address
+ */
+
+#ifndef REGMAP_H_
+#define REGMAP_H_
+
+#include <stdint.h>
+
+
+// Vendor requests, device recipient. wValue is the register address.
+#define REGMAP_REQUEST_READ			0x30	// IN, consecutive registers packed into wLength
+#define REGMAP_REQUEST_WRITE		0x31	// OUT, consecutive registers packed in the data stage
+#define REGMAP_REQUEST_INFO			0x32	// IN, regmap_info_t for one register
+
+// Types, the low nibble is the size in bytes. Values are little endian.
+#define REGMAP_TYPE_U8				0x01
+#define REGMAP_TYPE_U16				0x02
+#define REGMAP_TYPE_U32				0x04
+#define REGMAP_TYPE_S8				0x11
+#define REGMAP_TYPE_S16				0x12
+#define REGMAP_TYPE_S32				0x14
+#define REGMAP_TYPE_FLOAT			0x24
+#define REGMAP_TYPE_SIZE_gm			0x0F
+
+// Flags
+#define REGMAP_FLAG_READONLY_bm		(1<<0)
+
+#define REGMAP_NAME_LENGTH			12		// not null terminated if all used
+
+typedef struct
+{
+	void		*address;					// variable in RAM
+	uint8_t		type;
+	uint8_t		flags;
+	char		name[REGMAP_NAME_LENGTH];
+} regmap_entry_t;
+
+typedef struct
+{
+	uint16_t	count;						// number of registers in the map
+	uint8_t		type;
+	uint8_t		flags;
+	char		name[REGMAP_NAME_LENGTH];
+} regmap_info_t;
+
+#define REGMAP_ENTRY(var, t, f, n)	{ .address = (void *)&(var), .type = (t), .flags = (f), .name = n }
+
+
+#ifdef USB_REGMAP
+extern void regmap_control_setup(void);
+#endif
+
+
+#endif /* REGMAP_H_ */
@@ -15,20 +15,110 @@
 #include <string.h>
 
 #define USB_EP0_MAX_PACKET_SIZE		64
-#define USB_EP0_BUFFER_SIZE			194
+#define USB_EP0_BUFFER_SIZE			USB_EP0_MAX_PACKET_SIZE
 
 #include "usb_standard.h"
 #include "usb_config.h"
 
+// The CDC data interface is carried by the streaming bulk endpoints
+#ifdef USB_CDC
+#ifndef USB_STREAM_IN
+#define USB_STREAM_IN
+#endif
+#ifndef USB_STREAM_OUT
+#define USB_STREAM_OUT
+#endif
+#endif
+
+// Interface numbers in descriptor order, derived from the enabled features. Composite
+// devices are numbered from USB_COMPOSITE_FUNCTIONS in usb_composite.h instead.
+#ifndef USB_COMPOSITE
+enum {
+#if defined(USB_CDC)
+	CDC_COMM_INTERFACE,
+	CDC_DATA_INTERFACE,
+#elif defined(USB_MSC)
+	MSC_INTERFACE,
+#elif !defined(USB_DFU_MODE)
+	USB_MAIN_INTERFACE,			// HID or vendor bulk
+#endif
+#if defined(USB_DFU_RUNTIME) || defined(USB_DFU_MODE)
+	DFU_INTERFACE,
+#endif
+#ifdef USB_ISOCHRONOUS
+	USB_ISO_INTERFACE,
+#endif
+	USB_NUM_INTERFACES
+};
+
+// Endpoint addresses of the main interface, used by its descriptors, its class code and
+// to size the endpoint table. Composite devices assign them per function instead.
+#if defined(USB_HID)
+#define USB_MAIN_IN_EP			0x81		// interrupt IN
+#elif !defined(USB_DFU_MODE)
+#define USB_MAIN_IN_EP			0x81		// bulk IN: vendor streams, CDC data or MSC
+#define USB_MAIN_OUT_EP			0x02
+#endif
+#endif
+
+// HID idle rates and low latency sampling need HID
+#ifndef USB_HID
+#undef USB_HID_IDLE
+#undef USB_HID_LOW_LATENCY
+#endif
+
+// MS OS 2.0 descriptors carry the same information as the WCID ones
+#ifndef USB_WCID
+#undef USB_WCID_MSOS20
+#endif
+
+// Patch downloads are a DFU mode alternate setting
+#ifndef USB_DFU_MODE
+#undef USB_DFU_PATCH
+#endif
+
+// Low latency sampling and DFU page writes are timed from the frame counter
+#if (defined(USB_HID_LOW_LATENCY) || defined(USB_DFU_MODE)) && !defined(USB_FRAME_COUNTER)
+#define USB_FRAME_COUNTER
+#endif
+
+// HID features that are scheduled from the start of frame interrupt
+#if defined(USB_HID_IDLE) || defined(USB_HID_LOW_LATENCY)
+#define USB_HID_SOF
+#endif
+
+// Features that are scheduled from the start of frame interrupt
+#if defined(USB_ISOCHRONOUS) || defined(USB_FRAME_COUNTER) || defined(USB_HID_SOF)
+#define USB_SOF_INTERRUPT
+#endif
+
 extern USB_SetupPacket_t usb_setup;
-extern uint8_t ep0_buf_in[USB_EP0_BUFFER_SIZE];
-extern uint8_t ep0_buf_out[USB_EP0_BUFFER_SIZE];
+extern uint8_t ep0_buf[USB_EP0_BUFFER_SIZE];
+// IN and OUT share one buffer, the setup packet is copied to usb_setup when it arrives
+#define ep0_buf_in	ep0_buf
+
+// Control OUT data stages are accumulated into ep0_buf_out before the request is handled
+#ifdef USB_CONTROL_OUT_BUFFER_SIZE
+#define USB_EP0_OUT_BUFFER_SIZE		USB_CONTROL_OUT_BUFFER_SIZE
+extern uint8_t usb_control_out_buf[USB_CONTROL_OUT_BUFFER_SIZE];
+#define ep0_buf_out	usb_control_out_buf
+#else
+#define USB_EP0_OUT_BUFFER_SIZE		USB_EP0_BUFFER_SIZE
+#define ep0_buf_out	ep0_buf
+#endif
 extern volatile uint8_t USB_DeviceState;
 extern volatile uint8_t USB_Device_ConfigurationNumber;
+extern volatile bool usb_remote_wakeup_enabled;
 
 typedef size_t usb_size;
 typedef uint8_t usb_ep;
 typedef uint8_t usb_bank;
+typedef void (*usb_ep_callback_t)(usb_ep ep);
+
+typedef struct {
+	uint32_t	frame;		// extended frame number
+	uint16_t	ticks;		// USB_FRAME_TIMER ticks since that frame's SOF
+} usb_timestamp_t;
 
 /// Configure the XMEGA's clock for use with USB.
 void usb_configure_clock(void);
@@ -48,7 +138,21 @@ void usb_detach(void);
 /// Called internally on USB reset
 void usb_reset(void);
 
-/// Configure and enable an endpoint
+/// Handle pending control requests from the main loop when USB_DEFERRED_CONTROL is defined
+void usb_poll(void);
+
+/// Returns true while the host has the bus suspended
+bool usb_is_suspended(void);
+
+/// Sleep in power-down mode with the USB clock stopped until the bus is resumed
+void usb_suspend_sleep(void);
+
+/// Wake up a suspended host, if it has enabled remote wakeup. Returns false if not sent.
+bool usb_remote_wakeup(void);
+
+/// Configure and enable an endpoint. type may include USB_EP_MULTIPKT_bm and
+/// USB_EP_PINGPONG_bm. A ping-pong endpoint uses both halves of its endpoint pair, so
+/// the same endpoint number cannot be used in the other direction.
 void usb_ep_enable(usb_ep ep, uint8_t type, usb_size bufsize, bool enable_interrupt);
 
 /// Disable an endpoint
@@ -60,6 +164,7 @@ void usb_ep_reset(usb_ep ep);
 /// Set or clear stall on an endpoint
 void usb_ep_set_stall(usb_ep ep);
 void usb_ep_clr_stall(usb_ep ep);
+bool usb_ep_is_stalled(usb_ep ep);
 
 /// Returns true if an endpoint can start or queue a transfer
 bool usb_ep_is_ready(usb_ep ep);
@@ -70,9 +175,16 @@ bool usb_ep_is_transaction_complete(usb_ep ep);
 /// Clear a completion on an endpoint
 void usb_ep_clear_transaction_complete(usb_ep ep);
 
+/// Set a function to be called from the transaction complete interrupt when a transaction
+/// completes on an endpoint, or NULL to poll with usb_ep_is_transaction_complete(). The
+/// completion is cleared before the callback runs, so it can start the next transfer.
+void usb_ep_set_callback(usb_ep ep, usb_ep_callback_t callback);
+
 /// Start an asynchronous host->device transfer.
 /// The data will be received into data up to size len. This buffer must remain valid until
-/// the callback is called
+/// the callback is called. If the endpoint was enabled with USB_EP_MULTIPKT_bm, up to 1023
+/// bytes are received with a single completion. len should then be a multiple of the
+/// endpoint size, as the hardware always writes whole packets.
 void usb_ep_start_out(usb_ep ep, uint8_t* data, usb_size len);
 
 /// Gets the length of a pending completion on an OUT endpoint
@@ -84,5 +196,21 @@ usb_size usb_ep_get_out_transaction_length(usb_ep ep);
 /// size, an extra zero-length packet will be sent to terminate the transfer.
 void usb_ep_start_in(uint8_t ep, const uint8_t* data, usb_size size, bool zlp);
 
+/// Queue a transfer on a ping-pong endpoint. Returns false if both banks are in use.
+/// Buffers must remain valid until returned by usb_ep_dequeue().
+bool usb_ep_queue_in(usb_ep ep, const uint8_t* data, usb_size size, bool zlp);
+bool usb_ep_queue_out(usb_ep ep, uint8_t* data, usb_size len);
+
+/// Retire the oldest completed bank on a ping-pong endpoint, in the order they were
+/// queued. Returns false if it is still in progress. data and len may be NULL, for OUT
+/// endpoints len is the number of bytes received.
+bool usb_ep_dequeue(usb_ep ep, uint8_t** data, usb_size* len);
+
+/// Get the extended frame number. The low 11 bits match the host's frame number.
+uint32_t usb_frame_counter(void);
+
+/// Get the current (frame, sub-frame tick) time for stamping samples
+void usb_frame_timestamp(usb_timestamp_t *ts);
+
 
 #endif	// USB_H_
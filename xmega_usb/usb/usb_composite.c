@@ -0,0 +1,210 @@
+/* usb_composite.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Composite devices built from independent functions. The functions listed in
+ * USB_COMPOSITE_FUNCTIONS are given consecutive interface and endpoint numbers at compile
+ * time, the configuration descriptor is generated from their descriptors with an interface
+ * association descriptor in front of each one, and class and vendor requests are routed
+ * to the function that owns the interface or endpoint in wIndex.
+ */
+
+#include <avr/io.h>
+#include "usb.h"
+#include "usb_config.h"
+#include "usb_xmega.h"
+#include "usb_composite.h"
+#include "usb_stream.h"
+
+#ifdef USB_COMPOSITE
+
+#if defined(USB_ISOCHRONOUS) || defined(USB_CDC) || defined(USB_MSC) || defined(USB_DMA_IN)
+#error USB_COMPOSITE supports HID, vendor bulk and DFU runtime functions, undefine USB_ISOCHRONOUS, USB_CDC, USB_MSC and USB_DMA_IN
+#endif
+
+#define COMPOSITE_FUNCTION(f)			&USB_FUNCTION_##f,
+#define COMPOSITE_FIRST_INTERFACE(f)	USB_INTERFACE_##f,
+#define COMPOSITE_FIRST_ENDPOINT(f)		USB_ENDPOINT_##f,
+
+static const __flash usb_function_t * const __flash usb_functions[] = { USB_COMPOSITE_FUNCTIONS(COMPOSITE_FUNCTION) };
+static const __flash uint8_t composite_first_interface[] = { USB_COMPOSITE_FUNCTIONS(COMPOSITE_FIRST_INTERFACE) };
+static const __flash uint8_t composite_first_endpoint[] = { USB_COMPOSITE_FUNCTIONS(COMPOSITE_FIRST_ENDPOINT) };
+#define COMPOSITE_NUM_FUNCTIONS	(sizeof(usb_functions) / sizeof(usb_functions[0]))
+
+static uint16_t composite_config_length;
+
+
+/* Reset each function with its interface and endpoint numbers
+ */
+void usb_composite_reset(void)
+{
+	uint16_t length = sizeof(USB_ConfigurationDescriptor_t);
+
+	for (uint8_t i = 0; i < COMPOSITE_NUM_FUNCTIONS; i++)
+	{
+		const __flash usb_function_t *fn = usb_functions[i];
+		length += sizeof(USB_InterfaceAssociationDescriptor_t) + fn->descriptors_length;
+		if (fn->reset != NULL)
+			fn->reset(composite_first_interface[i], composite_first_endpoint[i]);
+	}
+	composite_config_length = length;
+}
+
+uint16_t usb_composite_config_length(void)
+{
+	return composite_config_length;
+}
+
+/* Copies the part of the generated descriptor that falls inside the requested window
+ */
+typedef struct
+{
+	uint8_t		*buf;
+	uint16_t	pos;
+	uint16_t	start;
+	uint16_t	end;
+} composite_window_t;
+
+static void composite_put(composite_window_t *w, const uint8_t *data, uint8_t len)
+{
+	while (len--)
+	{
+		if ((w->pos >= w->start) && (w->pos < w->end))
+			w->buf[w->pos - w->start] = *data;
+		data++;
+		w->pos++;
+	}
+}
+
+/* Copy a function's descriptors, renumbering interfaces and endpoints
+ */
+static void composite_put_function(composite_window_t *w, const __flash usb_function_t *fn,
+								   uint8_t first_interface, uint8_t first_endpoint)
+{
+	const __flash uint8_t *desc = fn->descriptors;
+	const __flash uint8_t *end = desc + fn->descriptors_length;
+
+	while ((desc < end) && (w->pos < w->end))
+	{
+		uint8_t len = desc[0];
+		if ((w->pos + len) <= w->start)		// entirely before the window
+		{
+			w->pos += len;
+			desc += len;
+			continue;
+		}
+
+		for (uint8_t i = 0; i < len; i++)
+		{
+			uint8_t b = desc[i];
+			if ((i == 2) && (desc[1] == USB_DTYPE_Interface))			// bInterfaceNumber
+				b += first_interface;
+			else if ((i == 2) && (desc[1] == USB_DTYPE_Endpoint))		// bEndpointAddress
+				b = (b & 0x80) | ((b & 0x0F) + first_endpoint - 1);
+			composite_put(w, &b, 1);
+		}
+		desc += len;
+	}
+}
+
+/* Configuration descriptor generator for usb_ep0_in_generator()
+ */
+void usb_composite_config_read(uint8_t *buf, uint16_t offset, uint8_t len)
+{
+	composite_window_t w = { .buf = buf, .pos = 0, .start = offset, .end = offset + len };
+
+	USB_ConfigurationDescriptor_t config = usb_composite_config_header;
+	config.wTotalLength = composite_config_length;
+	config.bNumInterfaces = USB_NUM_INTERFACES;
+	composite_put(&w, (uint8_t *)&config, sizeof(config));
+
+	for (uint8_t i = 0; (i < COMPOSITE_NUM_FUNCTIONS) && (w.pos < w.end); i++)
+	{
+		const __flash usb_function_t *fn = usb_functions[i];
+		USB_InterfaceAssociationDescriptor_t iad = {
+			.bLength = sizeof(USB_InterfaceAssociationDescriptor_t),
+			.bDescriptorType = USB_DTYPE_InterfaceAssociation,
+			.bFirstInterface = composite_first_interface[i],
+			.bInterfaceCount = fn->num_interfaces,
+			.bFunctionClass = fn->function_class,
+			.bFunctionSubClass = fn->function_subclass,
+			.bFunctionProtocol = fn->function_protocol,
+			.iFunction = 0
+		};
+		composite_put(&w, (uint8_t *)&iad, sizeof(iad));
+		composite_put_function(&w, fn, composite_first_interface[i], composite_first_endpoint[i]);
+	}
+}
+
+/* Find the function that owns the interface or endpoint in wIndex, or -1
+ */
+static int8_t composite_find_interface(uint8_t interface)
+{
+	for (uint8_t i = 0; i < COMPOSITE_NUM_FUNCTIONS; i++)
+	{
+		if ((interface >= composite_first_interface[i]) &&
+			(interface < composite_first_interface[i] + usb_functions[i]->num_interfaces))
+			return i;
+	}
+	return -1;
+}
+
+static int8_t composite_find_endpoint(uint8_t endpoint)
+{
+	uint8_t number = endpoint & 0x0F;
+	for (uint8_t i = 0; i < COMPOSITE_NUM_FUNCTIONS; i++)
+	{
+		if ((number >= composite_first_endpoint[i]) &&
+			(number < composite_first_endpoint[i] + usb_functions[i]->num_endpoints))
+			return i;
+	}
+	return -1;
+}
+
+/* Route class and vendor requests to the function addressed by wIndex
+ */
+void usb_composite_setup(void)
+{
+	int8_t i = -1;
+	switch (usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK)
+	{
+		case USB_RECIPIENT_INTERFACE:
+			i = composite_find_interface(usb_setup.wIndex & 0xFF);
+			break;
+		case USB_RECIPIENT_ENDPOINT:
+			i = composite_find_endpoint(usb_setup.wIndex & 0xFF);
+			break;
+	}
+
+	if ((i < 0) || (usb_functions[i]->setup == NULL))
+		return usb_ep0_stall();
+	usb_functions[i]->setup();
+}
+
+/* Route SET_INTERFACE to the function owning the interface
+ */
+bool usb_composite_set_interface(uint8_t interface, uint8_t altsetting)
+{
+	int8_t i = composite_find_interface(interface);
+	if (i < 0)
+		return false;
+	if (usb_functions[i]->set_interface == NULL)
+		return altsetting == 0;
+	return usb_functions[i]->set_interface(interface - composite_first_interface[i], altsetting);
+}
+
+/* Vendor bulk function, carries the streaming endpoints when they are enabled
+ */
+void usb_vendor_reset(uint8_t first_interface, uint8_t first_endpoint)
+{
+#ifdef USB_STREAM_IN
+	usb_stream_in_ep = 0x80 | first_endpoint;
+	usb_stream_in_reset();
+#endif
+#ifdef USB_STREAM_OUT
+	usb_stream_out_ep = first_endpoint + 1;
+	usb_stream_out_reset();
+#endif
+}
+
+#endif // USB_COMPOSITE
@@ -0,0 +1,77 @@
+/* usb_composite.h
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Composite devices built from independent functions
+ */
+
+#ifndef USB_COMPOSITE_H_
+#define USB_COMPOSITE_H_
+
+
+// A function is a group of interfaces and endpoints handled by one class module. Its
+// descriptors are written as if it were the only function, with interfaces numbered from
+// 0 and endpoints numbered from 1. Interface and endpoint numbers are assigned in the
+// order of USB_COMPOSITE_FUNCTIONS and patched as the configuration descriptor is sent.
+typedef struct
+{
+	const __flash uint8_t	*descriptors;		// interface, class and endpoint descriptors
+	uint16_t				descriptors_length;
+	uint8_t					num_interfaces;
+	uint8_t					num_endpoints;		// endpoint numbers used, IN and OUT
+
+	// interface association descriptor
+	uint8_t					function_class;
+	uint8_t					function_subclass;
+	uint8_t					function_protocol;
+
+	// called on USB reset with the assigned numbers, enables the function's endpoints
+	void					(*reset)(uint8_t first_interface, uint8_t first_endpoint);
+	// class and vendor requests addressed to one of the function's interfaces or endpoints
+	void					(*setup)(void);
+	// interface is relative to the function. NULL if only alternate setting 0 exists.
+	bool					(*set_interface)(uint8_t interface, uint8_t altsetting);
+} usb_function_t;
+
+
+// Available functions, with the number of interfaces and endpoint numbers each one uses
+#define USB_FUNCTION_HID					usb_hid_function
+#define USB_FUNCTION_HID_INTERFACES			1
+#define USB_FUNCTION_HID_ENDPOINTS			1
+#define USB_FUNCTION_VENDOR					usb_vendor_function
+#define USB_FUNCTION_VENDOR_INTERFACES		1
+#define USB_FUNCTION_VENDOR_ENDPOINTS		2		// separate numbers so both can be ping-pong
+#define USB_FUNCTION_DFU_RUNTIME			usb_dfu_runtime_function
+#define USB_FUNCTION_DFU_RUNTIME_INTERFACES	1
+#define USB_FUNCTION_DFU_RUNTIME_ENDPOINTS	0
+
+// USB_INTERFACE_<function> is the first interface of each function in
+// USB_COMPOSITE_FUNCTIONS, USB_ENDPOINT_<function> its first endpoint number
+#define USB_FUNCTION_INTERFACE_ENUM(f) \
+	USB_INTERFACE_##f, USB_INTERFACE_##f##_LAST = USB_INTERFACE_##f + USB_FUNCTION_##f##_INTERFACES - 1,
+#define USB_FUNCTION_ENDPOINT_ENUM(f) \
+	USB_ENDPOINT_##f, USB_ENDPOINT_##f##_LAST = USB_ENDPOINT_##f + USB_FUNCTION_##f##_ENDPOINTS - 1,
+
+
+#ifdef USB_COMPOSITE
+enum { USB_COMPOSITE_FUNCTIONS(USB_FUNCTION_INTERFACE_ENUM) USB_NUM_INTERFACES };
+enum { USB_ENDPOINT_CONTROL = 0, USB_COMPOSITE_FUNCTIONS(USB_FUNCTION_ENDPOINT_ENUM) USB_ENDPOINT_END };
+#define USB_COMPOSITE_ENDPOINTS		(USB_ENDPOINT_END - 1)
+
+// wTotalLength and bNumInterfaces are filled in when the descriptor is sent
+extern const __flash USB_ConfigurationDescriptor_t usb_composite_config_header;
+
+extern const __flash usb_function_t usb_hid_function;
+extern const __flash usb_function_t usb_vendor_function;
+extern const __flash usb_function_t usb_dfu_runtime_function;
+
+extern void		usb_composite_reset(void);
+extern uint16_t	usb_composite_config_length(void);
+extern void		usb_composite_config_read(uint8_t *buf, uint16_t offset, uint8_t len);
+extern void		usb_composite_setup(void);
+extern bool		usb_composite_set_interface(uint8_t interface, uint8_t altsetting);
+extern void		usb_vendor_reset(uint8_t first_interface, uint8_t first_endpoint);
+#endif
+
+
+#endif /* USB_COMPOSITE_H_ */
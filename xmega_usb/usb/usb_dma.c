@@ -0,0 +1,175 @@
+/* usb_dma.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * DMA driven peripheral to bulk IN pipeline. DMA channels 0 and 1 run in double buffer
+ * mode, alternately filling two endpoint buffers from a peripheral data register. Each
+ * time a buffer is full it is queued on the ping-pong endpoint 0x81 while the other
+ * channel fills the other buffer, so the CPU never touches the data.
+ *
+ * A buffer is only refilled once the host has collected it. If it hasn't, the channel
+ * that would refill it is stopped, and restarted from the endpoint completion interrupt
+ * once the block has been sent.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "usb.h"
+#include "usb_config.h"
+#include "usb_dma.h"
+
+#ifdef USB_DMA_IN
+
+#if defined(USB_HID) || defined(USB_STREAM_IN)
+#error USB_DMA_IN needs endpoint 0x81, undefine USB_HID and USB_STREAM_IN
+#endif
+_Static_assert(USB_DMA_IN_BUFFER_SIZE <= 1023, "USB_DMA_IN_BUFFER_SIZE exceeds maximum multi-packet transfer size");
+
+#define DMA_IN_EP		USB_MAIN_IN_EP
+
+static uint8_t dma_in_buf[2][USB_DMA_IN_BUFFER_SIZE] __attribute__((__aligned__(2)));
+
+// Times the stream stopped because the host had not collected a block in time
+volatile uint16_t usb_dma_in_overruns;
+
+// Buffers queued on the endpoint and not sent yet, bit n for dma_in_buf[n]. Only changed
+// from the DMA and USB interrupts, which run at the same level, or with interrupts off.
+static uint8_t dma_in_queued;
+static DMA_CH_t *dma_in_stopped;		// channel waiting for its buffer, or NULL
+
+static volatile void *dma_in_source;
+static uint8_t dma_in_trigger_source;
+static uint8_t dma_in_burst_length;
+
+
+/* Configure channel n of the pair to fill dma_in_buf[n] from the peripheral
+ */
+static void dma_in_setup_channel(uint8_t n)
+{
+	DMA_CH_t *ch = n ? &DMA.CH1 : &DMA.CH0;
+	uint8_t *buf = dma_in_buf[n];
+
+	ch->CTRLA = DMA_CH_RESET_bm;
+	ch->ADDRCTRL = DMA_CH_SRCRELOAD_BURST_gc | DMA_CH_SRCDIR_INC_gc |
+				   DMA_CH_DESTRELOAD_BLOCK_gc | DMA_CH_DESTDIR_INC_gc;
+	ch->TRIGSRC = dma_in_trigger_source;
+	ch->TRFCNT = USB_DMA_IN_BUFFER_SIZE;
+	ch->REPCNT = 0;		// repeat forever
+	ch->SRCADDR0 = (uint16_t)dma_in_source & 0xFF;
+	ch->SRCADDR1 = (uint16_t)dma_in_source >> 8;
+	ch->SRCADDR2 = 0;
+	ch->DESTADDR0 = (uint16_t)buf & 0xFF;
+	ch->DESTADDR1 = (uint16_t)buf >> 8;
+	ch->DESTADDR2 = 0;
+	ch->CTRLB = DMA_CH_TRNINTLVL_MED_gc;
+	ch->CTRLA = DMA_CH_REPEAT_bm | DMA_CH_SINGLE_bm | ((dma_in_burst_length - 1) & DMA_CH_BURSTLEN_gm);
+}
+
+/* Retire sent blocks, and restart a stopped channel once its buffer is free
+ */
+static void dma_in_retire(void)
+{
+	uint8_t *data;
+	while (usb_ep_dequeue(DMA_IN_EP, &data, NULL))
+		dma_in_queued &= (data == dma_in_buf[1]) ? ~2 : ~1;
+
+	if (dma_in_stopped != NULL)
+	{
+		uint8_t n = (dma_in_stopped == &DMA.CH1);
+		if (!(dma_in_queued & (1 << n)))
+		{
+			dma_in_setup_channel(n);
+			dma_in_stopped->CTRLA |= DMA_CH_ENABLE_bm;
+			dma_in_stopped = NULL;
+		}
+	}
+}
+
+/* Endpoint completion callback
+ */
+static void dma_in_ep_complete(usb_ep ep)
+{
+	dma_in_retire();
+}
+
+/* Called on USB reset, queued blocks are dropped
+ */
+void usb_dma_in_reset(void)
+{
+	usb_ep_enable(DMA_IN_EP, USB_EP_TYPE_BULK_gc | USB_EP_PINGPONG_bm | USB_EP_MULTIPKT_bm, 64, true);
+	usb_ep_set_callback(DMA_IN_EP, dma_in_ep_complete);
+	dma_in_queued = 0;
+	dma_in_retire();
+}
+
+/* Start streaming from a peripheral data register. Each trigger, usually an event system
+ * channel (DMA_CH_TRIGSRC_EVSYS_CH0_gc) or peripheral (e.g. DMA_CH_TRIGSRC_ADCA_CH0_gc),
+ * copies burst_length bytes (1 or 2) from source.
+ */
+void usb_dma_in_start(volatile void *source, uint8_t trigger_source, uint8_t burst_length)
+{
+	usb_dma_in_stop();
+	dma_in_source = source;
+	dma_in_trigger_source = trigger_source;
+	dma_in_burst_length = burst_length;
+	DMA.CTRL = DMA_ENABLE_bm | DMA_DBUFMODE_CH01_gc;
+	dma_in_setup_channel(0);
+	dma_in_setup_channel(1);
+
+	// channel 1 is enabled by hardware when 0 completes. Buffer 0 may still hold a block
+	// from before the last stop.
+	uint8_t saved_sreg = SREG;
+	cli();
+	dma_in_stopped = &DMA.CH0;
+	dma_in_retire();
+	SREG = saved_sreg;
+}
+
+/* Stop streaming. Blocks already queued are still sent.
+ */
+void usb_dma_in_stop(void)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	DMA.CH0.CTRLA = 0;
+	DMA.CH1.CTRLA = 0;
+	DMA.CTRL &= ~DMA_DBUFMODE_gm;
+	dma_in_stopped = NULL;
+	SREG = saved_sreg;
+}
+
+/* Hand buffer n to the endpoint. The hardware has just enabled the other channel, which
+ * refills the buffer of the block queued before this one. If the host hasn't collected
+ * that block yet the channel is stopped, normally before its first burst as the interrupt
+ * latency is short compared to the trigger interval, and the stream resumes from
+ * dma_in_retire() once the block has been sent.
+ */
+static inline void dma_in_block_complete(uint8_t n)
+{
+	dma_in_retire();
+	if (dma_in_queued & (1 << (n ^ 1)))
+	{
+		DMA_CH_t *other = n ? &DMA.CH0 : &DMA.CH1;
+		other->CTRLA = 0;
+		dma_in_stopped = other;
+		usb_dma_in_overruns++;
+	}
+
+	// only the other buffer can still be queued, so a bank is always free
+	usb_ep_queue_in(DMA_IN_EP, dma_in_buf[n], USB_DMA_IN_BUFFER_SIZE, false);
+	dma_in_queued |= 1 << n;
+}
+
+ISR(DMA_CH0_vect)
+{
+	DMA.CH0.CTRLB |= DMA_CH_TRNIF_bm;
+	dma_in_block_complete(0);
+}
+
+ISR(DMA_CH1_vect)
+{
+	DMA.CH1.CTRLB |= DMA_CH_TRNIF_bm;
+	dma_in_block_complete(1);
+}
+
+#endif // USB_DMA_IN
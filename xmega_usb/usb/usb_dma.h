@@ -0,0 +1,21 @@
+/* usb_dma.h
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * DMA driven peripheral to bulk IN pipeline
+ */
+
+#ifndef USB_DMA_H_
+#define USB_DMA_H_
+
+
+#ifdef USB_DMA_IN
+extern volatile uint16_t usb_dma_in_overruns;
+
+extern void usb_dma_in_reset(void);
+extern void usb_dma_in_start(volatile void *source, uint8_t trigger_source, uint8_t burst_length);
+extern void usb_dma_in_stop(void);
+#endif
+
+
+#endif /* USB_DMA_H_ */
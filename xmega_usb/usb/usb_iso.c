@@ -0,0 +1,95 @@
+/* usb_iso.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Isochronous endpoints, scheduled from the start of frame interrupt. The streaming
+ * interface has a zero bandwidth alternate setting 0, and alternate setting 1 with one
+ * isochronous IN and one isochronous OUT endpoint. While alternate setting 1 is selected
+ * one packet per frame is exchanged in each direction.
+ */
+
+#include <avr/io.h>
+#include "usb.h"
+#include "usb_config.h"
+#include "usb_iso.h"
+
+#ifdef USB_ISOCHRONOUS
+
+#ifdef USB_HID
+#error USB_ISOCHRONOUS is only supported with the vendor specific interface, undefine USB_HID
+#endif
+_Static_assert(USB_ISO_IN_SIZE <= 1023, "USB_ISO_IN_SIZE exceeds maximum isochronous packet size");
+_Static_assert(USB_ISO_OUT_SIZE <= 1023, "USB_ISO_OUT_SIZE exceeds maximum isochronous packet size");
+
+// Double buffered, so that a buffer is never written while the hardware may be using it
+static uint8_t iso_in_buf[2][USB_ISO_IN_SIZE] __attribute__((__aligned__(2)));
+static uint8_t iso_out_buf[2][USB_ISO_OUT_SIZE] __attribute__((__aligned__(2)));
+static uint8_t iso_in_bank;
+static uint8_t iso_out_bank;
+static uint8_t iso_altsetting;
+
+
+/* Called on USB reset
+ */
+void usb_iso_reset(void)
+{
+	usb_iso_set_interface(0);
+}
+
+/* Handle SET_INTERFACE for the streaming interface
+ */
+bool usb_iso_set_interface(uint8_t altsetting)
+{
+	if (altsetting > 1)
+		return false;
+
+	iso_altsetting = altsetting;
+	if (altsetting == 0)
+	{
+		usb_ep_disable(USB_ISO_IN_EP);
+		usb_ep_disable(USB_ISO_OUT_EP);
+		return true;
+	}
+
+	usb_ep_enable(USB_ISO_IN_EP, USB_EP_TYPE_ISOCHRONOUS_gc, USB_ISO_IN_SIZE, false);
+	usb_ep_enable(USB_ISO_OUT_EP, USB_EP_TYPE_ISOCHRONOUS_gc, USB_ISO_OUT_SIZE, false);
+	iso_out_bank = 0;
+	usb_ep_start_out(USB_ISO_OUT_EP, iso_out_buf[0], USB_ISO_OUT_SIZE);
+	iso_in_bank = 0;
+	usb_ep_start_in(USB_ISO_IN_EP, iso_in_buf[0], usb_cb_iso_in(iso_in_buf[0]), false);
+	return true;
+}
+
+/* Handle GET_INTERFACE for the streaming interface
+ */
+uint8_t usb_iso_get_interface(void)
+{
+	return iso_altsetting;
+}
+
+/* Called from the start of frame interrupt. The host performs at most one transaction per
+ * endpoint per frame, so the previous frame's packets are complete.
+ */
+void usb_iso_frame(void)
+{
+	if (iso_altsetting == 0)
+		return;
+
+	// IN: replace the packet for this frame, stale data is dropped if the host didn't
+	// collect it
+	iso_in_bank ^= 1;
+	usb_ep_start_in(USB_ISO_IN_EP, iso_in_buf[iso_in_bank], usb_cb_iso_in(iso_in_buf[iso_in_bank]), false);
+
+	// OUT: re-arm with the other buffer before handing the received packet over, so
+	// nothing is missed while the application processes it
+	if (usb_ep_is_transaction_complete(USB_ISO_OUT_EP))
+	{
+		uint8_t *packet = iso_out_buf[iso_out_bank];
+		usb_size len = usb_ep_get_out_transaction_length(USB_ISO_OUT_EP);
+		iso_out_bank ^= 1;
+		usb_ep_start_out(USB_ISO_OUT_EP, iso_out_buf[iso_out_bank], USB_ISO_OUT_SIZE);
+		usb_cb_iso_out(packet, len);
+	}
+}
+
+#endif // USB_ISOCHRONOUS
@@ -0,0 +1,26 @@
+/* usb_iso.h
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Isochronous endpoints, scheduled from the start of frame interrupt
+ */
+
+#ifndef USB_ISO_H_
+#define USB_ISO_H_
+
+
+#ifdef USB_ISOCHRONOUS
+
+// USB_ISO_INTERFACE is numbered in usb.h
+#define USB_ISO_IN_EP			0x83
+#define USB_ISO_OUT_EP			0x03
+
+extern void		usb_iso_reset(void);
+extern bool		usb_iso_set_interface(uint8_t altsetting);
+extern uint8_t	usb_iso_get_interface(void);
+extern void		usb_iso_frame(void);
+
+#endif // USB_ISOCHRONOUS
+
+
+#endif /* USB_ISO_H_ */
@@ -8,22 +8,62 @@
  */
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include "usb.h"
 #include "usb_config.h"
 #include "usb_xmega.h"
 #include "hid.h"
 #include "dfu.h"
+#include "usb_composite.h"
+#include "usb_iso.h"
+#include "regmap.h"
+#include "cdc.h"
+#include "msc.h"
+#include "xmega.h"
 
 USB_SetupPacket_t usb_setup;
-__attribute__((__aligned__(2))) uint8_t ep0_buf_in[USB_EP0_BUFFER_SIZE];
-__attribute__((__aligned__(2))) uint8_t ep0_buf_out[USB_EP0_BUFFER_SIZE];
+__attribute__((__aligned__(2))) uint8_t ep0_buf[USB_EP0_BUFFER_SIZE];
+#ifdef USB_CONTROL_OUT_BUFFER_SIZE
+_Static_assert((USB_CONTROL_OUT_BUFFER_SIZE % USB_EP0_MAX_PACKET_SIZE) == 0, "USB_CONTROL_OUT_BUFFER_SIZE must be a multiple of the EP0 packet size");
+__attribute__((__aligned__(2))) uint8_t usb_control_out_buf[USB_CONTROL_OUT_BUFFER_SIZE];
+#endif
 volatile uint8_t usb_configuration;
 
+// control IN data stage being sent from flash or a generator
+static usb_ep0_generator_t ep0_in_generator;
+static uint32_t ep0_in_address;		// flash address, or offset passed to the generator
+static uint16_t ep0_in_remaining;
+static bool ep0_in_pending;		// more packets to send after the current one
+static bool ep0_in_zlp;			// transfer shorter than wLength, end with a short packet
+
 
 extern uint16_t usb_handle_descriptor_request(uint8_t type, uint8_t index);
 extern void handle_msft_compatible(void);
 
 
+/**************************************************************************************************
+* Check that a request's endpoint address is one of the configured endpoints, other than
+* the default control pipe
+*/
+static bool usb_handle_valid_endpoint(uint16_t ep)
+{
+	uint8_t num = ep & 0x3F;
+	return (num != 0) && (num <= usb_num_endpoints) && !(ep & 0xFF40);
+}
+
+/**************************************************************************************************
+* Functions can refuse CLEAR_FEATURE(ENDPOINT_HALT), the request still succeeds but the
+* endpoint stays halted
+*/
+static bool usb_handle_clear_halt_allowed(uint16_t ep)
+{
+#ifdef USB_MSC
+	if ((ep == MSC_IN_EP) || (ep == MSC_OUT_EP))
+		return msc_clear_halt_allowed();
+#endif
+	return true;
+}
+
 /**************************************************************************************************
 * Handle standard setup requests
 */
@@ -38,12 +78,35 @@ void usb_handle_standard_setup_requests(void)
 			// Endpoint:	D0 endpoint halted
 			ep0_buf_in[0] = 0;
 			ep0_buf_in[1] = 0;
+			if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_ENDPOINT) &&
+				usb_handle_valid_endpoint(usb_setup.wIndex))
+				ep0_buf_in[0] = usb_ep_is_stalled(usb_setup.wIndex);
+#ifdef USB_REMOTE_WAKEUP
+			if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_DEVICE) &&
+				usb_remote_wakeup_enabled)
+				ep0_buf_in[0] = (1 << 1);
+#endif
 			usb_ep0_in(2);
 			return usb_ep0_out();
 
 		case USB_REQ_ClearFeature:
 		case USB_REQ_SetFeature:
-			// not implemented
+			if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_ENDPOINT) &&
+				(usb_setup.wValue == USB_FEATURE_EndpointHalt))
+			{
+				if (!usb_handle_valid_endpoint(usb_setup.wIndex))
+					return usb_ep0_stall();
+				if (usb_setup.bRequest == USB_REQ_SetFeature)
+					usb_ep_set_stall(usb_setup.wIndex);
+				else if (usb_handle_clear_halt_allowed(usb_setup.wIndex))
+					usb_ep_clr_stall(usb_setup.wIndex);
+			}
+#ifdef USB_REMOTE_WAKEUP
+			if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_DEVICE) &&
+				(usb_setup.wValue == USB_FEATURE_DeviceRemoteWakeup))
+				usb_remote_wakeup_enabled = (usb_setup.bRequest == USB_REQ_SetFeature);
+#endif
+			// other features not implemented
 			usb_ep0_in(0);
 			return usb_ep0_out();
 
@@ -57,17 +120,11 @@ void usb_handle_standard_setup_requests(void)
 		{
 			uint8_t type = usb_setup.wValue >> 8;
 			uint8_t index = usb_setup.wValue & 0xFF;
-			uint16_t size = usb_handle_descriptor_request(type, index);
 
-			if (size)
-			{
-				if (size > usb_setup.wLength)	// host requested partial descriptor
-					size = usb_setup.wLength;
-
-				return usb_ep_start_in(0x80, ep0_buf_in, size, true);
-			}
-			else
-				return usb_ep0_stall();
+			// starts the IN data stage if the descriptor exists
+			if (usb_handle_descriptor_request(type, index))
+				return;
+			return usb_ep0_stall();
 		}
 
 		case USB_REQ_GetConfiguration:
@@ -84,6 +141,22 @@ void usb_handle_standard_setup_requests(void)
 			}
 			return usb_ep0_stall();
 
+		// only valid for existing interfaces in the configured state (USB 2.0 9.4.4)
+		case USB_REQ_GetInterface:
+			if ((usb_configuration == 0) || (usb_setup.wIndex >= USB_NUM_INTERFACES))
+				return usb_ep0_stall();
+			ep0_buf_in[0] = 0;
+#ifdef USB_ISOCHRONOUS
+			if (usb_setup.wIndex == USB_ISO_INTERFACE)
+				ep0_buf_in[0] = usb_iso_get_interface();
+#endif
+#ifdef USB_DFU_MODE
+			if (usb_setup.wIndex == DFU_INTERFACE)
+				ep0_buf_in[0] = dfu_get_interface();
+#endif
+			usb_ep0_in(1);
+			return usb_ep0_out();
+
 		case USB_REQ_SetInterface:
 			if (usb_handle_set_interface(usb_setup.wIndex, usb_setup.wValue))
 			{
@@ -98,7 +171,98 @@ void usb_handle_standard_setup_requests(void)
 }
 
 /**************************************************************************************************
-* DFU vendor requests
+* Send the next packet of a flash or generator IN data stage
+*/
+static void usb_ep0_in_chunk_next(void)
+{
+#ifdef USB_DEFERRED_CONTROL
+	if (usb_ep0_superseded())
+		return;
+#endif
+	uint8_t size = USB_EP0_MAX_PACKET_SIZE;
+	if (ep0_in_remaining < USB_EP0_MAX_PACKET_SIZE)
+		size = ep0_in_remaining;
+
+	uint8_t cmd_backup = NVM.CMD;
+	NVM.CMD = 0;
+	if (ep0_in_generator != NULL)
+		ep0_in_generator(ep0_buf_in, ep0_in_address, size);
+	else
+		memcpy_PF(ep0_buf_in, ep0_in_address, size);
+	NVM.CMD = cmd_backup;
+
+	ep0_in_address += size;
+	ep0_in_remaining -= size;
+
+	// a short packet ends the data stage, or a zero length one if the data is a multiple
+	// of the packet size but shorter than the host asked for
+	ep0_in_pending = (size == USB_EP0_MAX_PACKET_SIZE) && (ep0_in_remaining || ep0_in_zlp);
+	usb_ep_start_in(0x80, ep0_buf_in, size, false);
+}
+
+/**************************************************************************************************
+* Send data from flash on the default control pipe. Only one packet is buffered in RAM at a
+* time, the rest is copied on each IN completion, so there is no limit on descriptor size.
+*/
+static void usb_ep0_in_chunked(usb_ep0_generator_t generator, uint32_t address, uint16_t size)
+{
+	ep0_in_zlp = false;
+	if (size < usb_setup.wLength)
+		ep0_in_zlp = true;
+	else
+		size = usb_setup.wLength;	// host requested partial descriptor
+
+	ep0_in_generator = generator;
+	ep0_in_address = address;
+	ep0_in_remaining = size;
+	usb_ep0_in_chunk_next();
+}
+
+void usb_ep0_in_flash(uint32_t address, uint16_t size)
+{
+	usb_ep0_in_chunked(NULL, address, size);
+}
+
+/**************************************************************************************************
+* Send data produced by generator on the default control pipe. The generator is called
+* from each IN completion to fill the next packet, so the data never has to exist in RAM
+* all at once. Flash is readable with LPM/ELPM while it runs.
+*/
+void usb_ep0_in_generator(usb_ep0_generator_t generator, uint16_t size)
+{
+	usb_ep0_in_chunked(generator, 0, size);
+}
+
+/**************************************************************************************************
+* DFU_REQUEST_CRC, the NVM controller's CRC of the application and boot sections. Lets
+* update tooling check the running firmware, or verify a download, without reading it back.
+* The CPU is halted while the CRC is computed.
+*/
+#if defined(USB_DFU_RUNTIME) || defined(USB_DFU_MODE)
+void dfu_crc_setup(void)
+{
+	uint32_t length = ((uint32_t)usb_setup.wIndex << 16) | usb_setup.wValue;
+	if (length > APP_SECTION_SIZE)
+		return usb_ep0_stall();
+
+	NVM_wait_not_busy();
+	DFU_CRCResponse_t *crc = (DFU_CRCResponse_t *)ep0_buf_in;
+	if (length == 0)
+		crc->application = NVM_application_crc();
+	else
+		crc->application = NVM_flash_range_crc(APP_SECTION_START, APP_SECTION_START + length - 1);
+	crc->boot = NVM_boot_crc();
+
+	uint8_t len = sizeof(DFU_CRCResponse_t);
+	if (usb_setup.wLength < len)
+		len = usb_setup.wLength;
+	usb_ep0_in(len);
+	return usb_ep0_out();
+}
+#endif
+
+/**************************************************************************************************
+* DFU run-time requests, DFU mode is handled by dfu.c
 */
 #ifdef USB_DFU_RUNTIME
 void dfu_control_setup(void)
@@ -146,17 +310,11 @@ void dfu_control_setup(void)
 #endif
 
 /**************************************************************************************************
-* Handle class setup requests
+* HID class requests
 */
-void usb_handle_class_setup_requests(void)
-{
-#if defined(USB_DFU_RUNTIME) || defined(USB_DFU_MODE)
-	if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_INTERFACE) &&
-		(usb_setup.wIndex == DFU_INTERFACE))
-		return dfu_control_setup();
-#endif
-
 #ifdef USB_HID
+void hid_control_setup(void)
+{
 	switch (usb_setup.bRequest)
 	{
 		// IN requests
@@ -166,7 +324,7 @@ void usb_handle_class_setup_requests(void)
 			{
 				case USB_HID_REPORT_TYPE_INPUT:
 				{
-					int16_t size = hid_cb_get_report_input(ep0_buf_in, usb_setup.wIndex & 0xFF);
+					int16_t size = hid_cb_get_report_input(ep0_buf_in, usb_setup.wValue & 0xFF);
 					if (size == -1)
 						return usb_ep0_stall();
 					usb_ep0_in(size);
@@ -194,7 +352,18 @@ void usb_handle_class_setup_requests(void)
 		}
 
 		case USB_HIDREQ_GET_IDLE:
+		{
+#ifdef USB_HID_IDLE
+			int16_t rate = hid_get_idle(usb_setup.wValue & 0xFF);
+			if (rate < 0)
+				return usb_ep0_stall();
+			ep0_buf_in[0] = rate;
+			usb_ep0_in(1);
+			return usb_ep0_out();
+#else
 			return usb_ep0_stall();
+#endif
+		}
 
 		case USB_HIDREQ_GET_PROTOCOL:
 			return usb_ep0_stall();
@@ -231,6 +400,10 @@ void usb_handle_class_setup_requests(void)
 		}
 
 		case USB_HIDREQ_SET_IDLE:
+#ifdef USB_HID_IDLE
+			if (!hid_set_idle(usb_setup.wValue & 0xFF, usb_setup.wValue >> 8))
+				return usb_ep0_stall();
+#endif
 			usb_ep0_in(0);
 			return usb_ep0_out();
 
@@ -240,9 +413,41 @@ void usb_handle_class_setup_requests(void)
 		default:
 			return usb_ep0_stall();
 	}
+}
+#endif
+
+/**************************************************************************************************
+* Handle class setup requests
+*/
+void usb_handle_class_setup_requests(void)
+{
+#ifdef USB_COMPOSITE
+	return usb_composite_setup();
+#else
+#if defined(USB_DFU_RUNTIME) || defined(USB_DFU_MODE)
+	if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_INTERFACE) &&
+		(usb_setup.wIndex == DFU_INTERFACE))
+		return dfu_control_setup();
+#endif
+
+#ifdef USB_CDC
+	if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_INTERFACE) &&
+		(usb_setup.wIndex == CDC_COMM_INTERFACE))
+		return cdc_control_setup();
+#endif
+
+#ifdef USB_MSC
+	if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_INTERFACE) &&
+		(usb_setup.wIndex == MSC_INTERFACE))
+		return msc_control_setup();
+#endif
+
+#ifdef USB_HID
+	return hid_control_setup();
 #else
 	return usb_ep0_stall();
 #endif
+#endif // USB_COMPOSITE
 }
 
 /**************************************************************************************************
@@ -258,6 +463,16 @@ void usb_handle_vendor_setup_requests(void)
 #ifdef USB_WCID
 			case WCID_REQUEST_ID:
 				return handle_msft_compatible();
+#endif
+#ifdef USB_REGMAP
+			case REGMAP_REQUEST_READ:
+			case REGMAP_REQUEST_WRITE:
+			case REGMAP_REQUEST_INFO:
+				return regmap_control_setup();
+#endif
+#if defined(USB_DFU_RUNTIME) || defined(USB_DFU_MODE)
+			case DFU_REQUEST_CRC:
+				return dfu_crc_setup();
 #endif
 		}
 	}
@@ -272,7 +487,11 @@ void usb_handle_vendor_setup_requests(void)
 		}
 	}
 
+#ifdef USB_COMPOSITE
+	return usb_composite_setup();
+#else
 	return usb_ep0_stall();
+#endif
 }
 
 /**************************************************************************************************
@@ -280,6 +499,8 @@ void usb_handle_vendor_setup_requests(void)
 */
 void usb_handle_control_setup(void)
 {
+	ep0_in_pending = false;		// host abandoned any unfinished data stage
+
 	switch (usb_setup.bmRequestType & USB_REQTYPE_TYPE_MASK)
 	{
 		case USB_REQTYPE_STANDARD:
@@ -306,6 +527,8 @@ void usb_handle_control_out(void)
 */
 void usb_handle_control_in(void)
 {
+	if (ep0_in_pending)
+		usb_ep0_in_chunk_next();
 }
 
 /**************************************************************************************************
@@ -313,5 +536,17 @@ void usb_handle_control_in(void)
 */
 bool usb_handle_set_interface(uint16_t interface, uint16_t altsetting)
 {
+#ifdef USB_COMPOSITE
+	return usb_composite_set_interface(interface, altsetting);
+#else
+#ifdef USB_ISOCHRONOUS
+	if (interface == USB_ISO_INTERFACE)
+		return usb_iso_set_interface(altsetting);
+#endif
+#ifdef USB_DFU_MODE
+	if (interface == DFU_INTERFACE)
+		return dfu_set_interface(altsetting);
+#endif
 	return false;
+#endif
 }
@@ -94,6 +94,8 @@ enum {
 	USB_DTYPE_Other = 0x07,
 	USB_DTYPE_InterfacePower = 0x08,
 	USB_DTYPE_InterfaceAssociation = 0x0B,
+	USB_DTYPE_BOS = 0x0F,
+	USB_DTYPE_DeviceCapability = 0x10,
 	USB_DTYPE_HID = 0x21,
 	USB_DTYPE_Report = 0x22,
 	USB_DTYPE_Physical = 0x23,
@@ -255,5 +257,81 @@ typedef struct {
 	USB_MicrosoftCompatibleDescriptor_Interface_t interfaces[];
 } __attribute__((packed)) USB_MicrosoftCompatibleDescriptor_t;
 
+/// Binary device Object Store, requested by hosts when bcdUSB is 0x0201 or later
+typedef struct {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t wTotalLength;
+	uint8_t bNumDeviceCaps;
+} __attribute__((packed)) USB_BOSDescriptor_t;
+
+#define USB_DCAP_USB20Extension				0x02
+#define USB_DCAP_Platform					0x05
+
+typedef struct {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDevCapabilityType;
+	uint32_t bmAttributes;
+} __attribute__((packed)) USB_USB20ExtensionDescriptor_t;
+
+/// Microsoft OS 2.0 platform capability, points the host at the descriptor set
+typedef struct {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDevCapabilityType;
+	uint8_t bReserved;
+	uint8_t PlatformCapabilityUUID[16];
+	uint32_t dwWindowsVersion;
+	uint16_t wMSOSDescriptorSetTotalLength;
+	uint8_t bMS_VendorCode;
+	uint8_t bAltEnumCode;
+} __attribute__((packed)) USB_MicrosoftPlatformCapabilityDescriptor_t;
+
+// D8DD60DF-4589-4CC7-9CD2-659D9E648A9F, mixed endian
+#define MSOS20_PLATFORM_UUID	{ 0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C, \
+								  0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F }
+#define MSOS20_WINDOWS_8_1					0x06030000
+#define MSOS20_DESCRIPTOR_INDEX				0x07	// wIndex of the vendor request
+
+enum {
+	MSOS20_SET_HEADER_DESCRIPTOR = 0x00,
+	MSOS20_SUBSET_HEADER_CONFIGURATION = 0x01,
+	MSOS20_SUBSET_HEADER_FUNCTION = 0x02,
+	MSOS20_FEATURE_COMPATIBLE_ID = 0x03,
+	MSOS20_FEATURE_REG_PROPERTY = 0x04,
+};
+
+/// Microsoft OS 2.0 descriptor set, all headers have 16 bit lengths and types
+typedef struct {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint32_t dwWindowsVersion;
+	uint16_t wTotalLength;
+} __attribute__((packed)) USB_MicrosoftOS20SetHeader_t;
+
+typedef struct {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint8_t bConfigurationValue;
+	uint8_t bReserved;
+	uint16_t wTotalLength;
+} __attribute__((packed)) USB_MicrosoftOS20ConfigurationSubset_t;
+
+typedef struct {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint8_t bFirstInterface;
+	uint8_t bReserved;
+	uint16_t wSubsetLength;
+} __attribute__((packed)) USB_MicrosoftOS20FunctionSubset_t;
+
+typedef struct {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint8_t CompatibleID[8];
+	uint8_t SubCompatibleID[8];
+} __attribute__((packed)) USB_MicrosoftOS20CompatibleID_t;
+
 
 #endif	// USB_STANDARD_H_
@@ -0,0 +1,264 @@
+/* usb_stream.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Ring buffered streaming over the bulk endpoints
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "usb.h"
+#include "usb_config.h"
+#include "usb_stream.h"
+
+#ifdef USB_STREAM_IN
+
+#if defined(USB_HID) && !defined(USB_COMPOSITE)
+#error USB_STREAM_IN needs the vendor bulk endpoints, undefine USB_HID or define USB_COMPOSITE
+#endif
+_Static_assert((USB_STREAM_IN_SIZE & (USB_STREAM_IN_SIZE - 1)) == 0, "USB_STREAM_IN_SIZE must be a power of two");
+
+#ifdef USB_COMPOSITE
+uint8_t usb_stream_in_ep = 0x81;	// assigned by the vendor function
+#define STREAM_IN_EP			usb_stream_in_ep
+#else
+#define STREAM_IN_EP			USB_MAIN_IN_EP
+#endif
+#define STREAM_IN_MAX_TRANSFER	960		// largest multiple of the packet size that fits in CNT
+
+static uint8_t stream_in_buf[USB_STREAM_IN_SIZE] __attribute__((__aligned__(2)));
+
+// Free running indexes, masked when accessing the buffer. The producer owns head, the
+// transaction complete interrupt owns tail. Data between tail and queued is owned by the
+// endpoint banks.
+static volatile uint16_t stream_in_head;
+static volatile uint16_t stream_in_tail;
+static uint16_t stream_in_queued;
+
+// Lengths of the chunks queued on each bank, retired in the same order as the banks
+static uint16_t stream_in_chunk[2];
+static uint8_t stream_in_fill;
+static uint8_t stream_in_done;
+
+
+/* Queue the largest contiguous regions of the ring on any free endpoint banks. Must be
+ * called with interrupts disabled.
+ */
+static void stream_in_queue(void)
+{
+	for (;;)
+	{
+		uint16_t pending = stream_in_head - stream_in_queued;
+		if (pending == 0)
+			return;
+
+		uint16_t offset = stream_in_queued & (USB_STREAM_IN_SIZE - 1);
+		uint16_t count = USB_STREAM_IN_SIZE - offset;
+		if (count > pending)
+			count = pending;
+		if (count > STREAM_IN_MAX_TRANSFER)
+			count = STREAM_IN_MAX_TRANSFER;
+
+		// terminate the host's read with a ZLP if this drains the ring
+		if (!usb_ep_queue_in(STREAM_IN_EP, &stream_in_buf[offset], count, count == pending))
+			return;
+
+		stream_in_chunk[stream_in_fill] = count;
+		stream_in_fill ^= 1;
+		stream_in_queued += count;
+	}
+}
+
+/* Endpoint completion callback, release sent data and send more
+ */
+static void stream_in_complete(usb_ep ep)
+{
+	while (usb_ep_dequeue(ep, NULL, NULL))
+	{
+		stream_in_tail += stream_in_chunk[stream_in_done];
+		stream_in_done ^= 1;
+	}
+	stream_in_queue();
+}
+
+/* Called on USB reset. Anything that was being sent is sent again.
+ */
+void usb_stream_in_reset(void)
+{
+	usb_ep_enable(STREAM_IN_EP, USB_EP_TYPE_BULK_gc | USB_EP_PINGPONG_bm | USB_EP_MULTIPKT_bm, 64, true);
+	usb_ep_set_callback(STREAM_IN_EP, stream_in_complete);
+	stream_in_queued = stream_in_tail;
+	stream_in_fill = 0;
+	stream_in_done = 0;
+	stream_in_queue();
+}
+
+/* Number of bytes that can be written to the ring
+ */
+uint16_t usb_stream_in_free(void)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	uint16_t used = stream_in_head - stream_in_tail;
+	SREG = saved_sreg;
+	return USB_STREAM_IN_SIZE - used;
+}
+
+/* Get a pointer to the largest contiguous free region of the ring, so that the producer
+ * can write into it directly. *len is set to its size. Follow with usb_stream_in_commit().
+ */
+uint8_t* usb_stream_in_reserve(uint16_t *len)
+{
+	uint16_t offset = stream_in_head & (USB_STREAM_IN_SIZE - 1);
+	uint16_t free = usb_stream_in_free();
+	if (free > USB_STREAM_IN_SIZE - offset)
+		free = USB_STREAM_IN_SIZE - offset;
+	*len = free;
+	return &stream_in_buf[offset];
+}
+
+/* Send len bytes written to the region returned by usb_stream_in_reserve()
+ */
+void usb_stream_in_commit(uint16_t len)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	stream_in_head += len;
+	stream_in_queue();
+	SREG = saved_sreg;
+}
+
+/* Copy data into the ring and start sending it. Returns the number of bytes accepted,
+ * which is less than len if the ring is full.
+ */
+uint16_t usb_stream_in_write(const uint8_t *data, uint16_t len)
+{
+	uint16_t written = 0;
+	while (written < len)
+	{
+		uint16_t count;
+		uint8_t *dst = usb_stream_in_reserve(&count);
+		if (count == 0)
+			break;
+		if (count > len - written)
+			count = len - written;
+		memcpy(dst, data + written, count);
+		usb_stream_in_commit(count);
+		written += count;
+	}
+	return written;
+}
+
+#endif // USB_STREAM_IN
+
+
+#ifdef USB_STREAM_OUT
+
+#if defined(USB_HID) && !defined(USB_COMPOSITE)
+#error USB_STREAM_OUT needs the vendor bulk endpoints, undefine USB_HID or define USB_COMPOSITE
+#endif
+_Static_assert((USB_STREAM_OUT_PACKETS & (USB_STREAM_OUT_PACKETS - 1)) == 0, "USB_STREAM_OUT_PACKETS must be a power of two");
+_Static_assert(USB_STREAM_OUT_PACKETS >= 2, "USB_STREAM_OUT_PACKETS must be at least two");
+
+#ifdef USB_COMPOSITE
+uint8_t usb_stream_out_ep = 0x02;	// assigned by the vendor function
+#define STREAM_OUT_EP			usb_stream_out_ep
+#else
+#define STREAM_OUT_EP			USB_MAIN_OUT_EP
+#endif
+#define STREAM_OUT_PACKET_SIZE	64
+
+// Packets are received straight into slots of the ring, so that the endpoint can be
+// re-armed without copying
+static uint8_t stream_out_buf[USB_STREAM_OUT_PACKETS][STREAM_OUT_PACKET_SIZE] __attribute__((__aligned__(2)));
+static uint8_t stream_out_len[USB_STREAM_OUT_PACKETS];
+
+// Free running slot indexes. Slots between tail and head hold received data, slots
+// between head and armed are queued on the endpoint banks.
+static volatile uint8_t stream_out_head;
+static volatile uint8_t stream_out_tail;
+static uint8_t stream_out_armed;
+static volatile uint16_t stream_out_count;
+static uint8_t stream_out_offset;	// read position in the tail slot
+
+
+/* Queue free slots on the endpoint banks. When the ring is full nothing is queued and
+ * the endpoint NAKs until the consumer frees a slot. Must be called with interrupts
+ * disabled.
+ */
+static void stream_out_arm(void)
+{
+	while ((uint8_t)(stream_out_armed - stream_out_tail) < USB_STREAM_OUT_PACKETS)
+	{
+		if (!usb_ep_queue_out(STREAM_OUT_EP, stream_out_buf[stream_out_armed & (USB_STREAM_OUT_PACKETS - 1)], STREAM_OUT_PACKET_SIZE))
+			return;
+		stream_out_armed++;
+	}
+}
+
+/* Endpoint completion callback, move received packets into the ring and re-arm
+ */
+static void stream_out_complete(usb_ep ep)
+{
+	usb_size len;
+	while (usb_ep_dequeue(ep, NULL, &len))
+	{
+		stream_out_len[stream_out_head & (USB_STREAM_OUT_PACKETS - 1)] = len;
+		stream_out_head++;
+		stream_out_count += len;
+	}
+	stream_out_arm();
+}
+
+/* Called on USB reset. Received data is kept.
+ */
+void usb_stream_out_reset(void)
+{
+	usb_ep_enable(STREAM_OUT_EP, USB_EP_TYPE_BULK_gc | USB_EP_PINGPONG_bm, STREAM_OUT_PACKET_SIZE, true);
+	usb_ep_set_callback(STREAM_OUT_EP, stream_out_complete);
+	stream_out_armed = stream_out_head;
+	stream_out_arm();
+}
+
+/* Number of received bytes waiting to be read
+ */
+uint16_t usb_stream_out_available(void)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	uint16_t count = stream_out_count;
+	SREG = saved_sreg;
+	return count;
+}
+
+/* Copy up to len received bytes into data. Returns the number of bytes copied. Slots
+ * that have been emptied are handed back to the endpoint.
+ */
+uint16_t usb_stream_out_read(uint8_t *data, uint16_t len)
+{
+	uint16_t read = 0;
+	while ((read < len) && (stream_out_tail != stream_out_head))
+	{
+		uint8_t slot = stream_out_tail & (USB_STREAM_OUT_PACKETS - 1);
+		uint8_t count = stream_out_len[slot] - stream_out_offset;
+		if (count > len - read)
+			count = len - read;
+		memcpy(data + read, &stream_out_buf[slot][stream_out_offset], count);
+		read += count;
+		stream_out_offset += count;
+
+		uint8_t saved_sreg = SREG;
+		cli();
+		stream_out_count -= count;
+		if (stream_out_offset >= stream_out_len[slot])
+		{
+			stream_out_offset = 0;
+			stream_out_tail++;
+			stream_out_arm();
+		}
+		SREG = saved_sreg;
+	}
+	return read;
+}
+
+#endif // USB_STREAM_OUT
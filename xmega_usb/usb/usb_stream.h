@@ -0,0 +1,33 @@
+/* usb_stream.h
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Ring buffered streaming over the bulk endpoints
+ */
+
+#ifndef USB_STREAM_H_
+#define USB_STREAM_H_
+
+
+#ifdef USB_STREAM_IN
+#ifdef USB_COMPOSITE
+extern uint8_t	usb_stream_in_ep;
+#endif
+extern void		usb_stream_in_reset(void);
+extern uint16_t	usb_stream_in_free(void);
+extern uint16_t	usb_stream_in_write(const uint8_t *data, uint16_t len);
+extern uint8_t*	usb_stream_in_reserve(uint16_t *len);
+extern void		usb_stream_in_commit(uint16_t len);
+#endif
+
+#ifdef USB_STREAM_OUT
+#ifdef USB_COMPOSITE
+extern uint8_t	usb_stream_out_ep;
+#endif
+extern void		usb_stream_out_reset(void);
+extern uint16_t	usb_stream_out_available(void);
+extern uint16_t	usb_stream_out_read(uint8_t *data, uint16_t len);
+#endif
+
+
+#endif /* USB_STREAM_H_ */
@@ -13,12 +13,48 @@
 #include "usb_xmega.h"
 #include "usb_xmega_internal.h"
 #include "xmega.h"
+#include "hid.h"
+#include "dfu.h"
+#include "usb_stream.h"
+#include "usb_dma.h"
+#include "usb_iso.h"
+#include "cdc.h"
+#include "msc.h"
+#include "usb_composite.h"
 
 
 #define _USB_EP(epaddr) \
 	USB_EP_pair_t* pair = &usb_xmega_endpoints[(epaddr & 0x3F)]; \
 	USB_EP_t* e __attribute__ ((unused)) = &pair->ep[!!(epaddr&0x80)]; \
 
+#ifdef USB_FIFO
+static uint8_t usb_fifo_rp;		// shadow of USB.FIFORP, reading the register pops an entry
+#endif
+
+static uint16_t ep0_out_received;	// bytes of the control OUT data stage received so far
+static bool ep0_out_pending;		// control OUT request waiting for its data stage
+
+#ifdef USB_DEFERRED_CONTROL
+#define USB_CONTROL_SETUP_PENDING	0x01
+#define USB_CONTROL_IN_PENDING		0x02
+static volatile uint8_t usb_control_pending;	// handled by usb_poll()
+static volatile bool usb_control_busy;			// usb_poll() is running a handler
+
+// SETUP packets land here once a request has been captured, so that a new one can't
+// overwrite ep0_buf while usb_poll() handles the last
+static uint8_t usb_setup_landing[USB_EP0_MAX_PACKET_SIZE] __attribute__((__aligned__(2)));
+
+static inline void usb_handle_ep0_out(void);
+#endif
+
+static volatile bool usb_suspended;
+static volatile bool usb_wakeup_requested;	// usb_remote_wakeup() called, waiting for the resume
+volatile bool usb_remote_wakeup_enabled;	// set by the host with SET_FEATURE(DEVICE_REMOTE_WAKEUP)
+
+#ifdef USB_FRAME_COUNTER
+static volatile uint32_t usb_frame;
+static volatile uint16_t usb_frame_sof_ticks;	// USB_FRAME_TIMER latched at last SOF
+#endif
 
 /**************************************************************************************************
 * Initialize up USB after reset
@@ -29,10 +65,19 @@ void usb_init()
 	cli();
 	USB.CAL0 = NVM_read_production_signature_byte(offsetof(NVM_PROD_SIGNATURES_t, USBCAL0));
 	USB.CAL1 = NVM_read_production_signature_byte(offsetof(NVM_PROD_SIGNATURES_t, USBCAL1));
+#ifdef USB_SOF_INTERRUPT
+	USB.INTCTRLA = USB_SOFIE_bm | USB_BUSEVIE_bm | USB_INTLVL_MED_gc;
+#else
 	USB.INTCTRLA = USB_BUSEVIE_bm | USB_INTLVL_MED_gc;
+#endif
 	USB.INTCTRLB = USB_TRNIE_bm | USB_SETUPIE_bm;
 	SREG = saved_sreg;
 
+#ifdef USB_FRAME_COUNTER
+	USB_FRAME_TIMER.PER = 0xFFFF;
+	USB_FRAME_TIMER.CTRLA = USB_FRAME_TIMER_CLKSEL;
+#endif
+
 	usb_reset();
 }
 
@@ -41,6 +86,13 @@ void usb_init()
 */
 void usb_reset()
 {
+	usb_suspended = false;
+	usb_wakeup_requested = false;
+	usb_remote_wakeup_enabled = false;
+#ifdef USB_DEFERRED_CONTROL
+	usb_control_pending = 0;
+#endif
+
 	USB.EPPTR = (unsigned) usb_xmega_endpoints;
 	USB.ADDR = 0;
 
@@ -52,11 +104,45 @@ void usb_reset()
 	usb_xmega_endpoints[0].in.CTRL = USB_EP_TYPE_CONTROL_gc | USB_EP_MULTIPKT_bm | USB_EP_size_to_gc(USB_EP0_MAX_PACKET_SIZE);
 	usb_xmega_endpoints[0].in.DATAPTR = (unsigned) ep0_buf_in;
 
+#ifdef USB_COMPOSITE
+	usb_composite_reset();
+#else
 #ifdef USB_HID
-	usb_ep_enable(0x81, USB_EP_TYPE_BULK_gc, 64, false);
+	hid_reset(USB_MAIN_INTERFACE, USB_MAIN_IN_EP & 0x0F);
+#endif
+#ifdef USB_CDC
+	cdc_reset();
 #endif
+#ifdef USB_MSC
+	msc_reset();
+#endif
+#ifdef USB_STREAM_IN
+	usb_stream_in_reset();
+#endif
+#ifdef USB_STREAM_OUT
+	usb_stream_out_reset();
+#endif
+#ifdef USB_DMA_IN
+	usb_dma_in_reset();
+#endif
+#ifdef USB_ISOCHRONOUS
+	usb_iso_reset();
+#endif
+#ifdef USB_DFU_MODE
+	dfu_reset();
+#endif
+#endif // USB_COMPOSITE
 
-	USB.CTRLA = USB_ENABLE_bm | USB_SPEED_bm | usb_num_endpoints;
+	uint8_t ctrla = USB_ENABLE_bm | USB_SPEED_bm | usb_num_endpoints;
+#ifdef USB_FIFO
+	USB.FIFOWP = 0;		// reset FIFO read and write pointers
+	usb_fifo_rp = 0;
+	ctrla |= USB_FIFOEN_bm;
+#endif
+#ifdef USB_FRAME_COUNTER
+	ctrla |= USB_STFRNUM_bm;	// store frame number above the endpoint table
+#endif
+	USB.CTRLA = ctrla;
 }
 
 /**************************************************************************************************
@@ -65,11 +151,21 @@ void usb_reset()
 * type				USB_EP_TYPE_*_gc
 * buffer_size		maximum payload size for endpoint
 * enable_interrupt	enable transaction complete interrupt
+*
+* In ping-pong mode the endpoint in the opposite direction is disabled and its DATAPTR,
+* CNT and AUXDATA registers are used for bank 1.
 */
 inline void usb_ep_enable(uint8_t ep, uint8_t type, usb_size buffer_size, bool enable_interrupt)
 {
 	_USB_EP(ep);
-	e->STATUS = USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm;
+	if (type & USB_EP_PINGPONG_bm)
+	{
+		pair->ep[!(ep & 0x80)].CTRL = 0;
+		usb_xmega_pingpong[ep & 0x3F] = 0;
+		e->STATUS = USB_EP_BUSNACK0_bm | USB_EP_BUSNACK1_bm;
+	}
+	else
+		e->STATUS = USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm;
 	e->CTRL = type | USB_EP_size_to_gc(buffer_size) | (enable_interrupt ? 0 : USB_EP_INTDSBL_bm);
 }
 
@@ -91,13 +187,46 @@ inline void usb_ep_reset(uint8_t ep)
 	e->STATUS = USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm;
 }
 
+/**************************************************************************************************
+* Stall an endpoint, until the host clears the halt feature
+*/
+void usb_ep_set_stall(uint8_t ep)
+{
+	_USB_EP(ep);
+	e->CTRL |= USB_EP_STALL_bm;
+}
+
+/**************************************************************************************************
+* Clear an endpoint stall. The data toggle is reset, as required after CLEAR_FEATURE(HALT).
+*/
+void usb_ep_clr_stall(uint8_t ep)
+{
+	_USB_EP(ep);
+	e->CTRL &= ~USB_EP_STALL_bm;
+	LACR16(&(e->STATUS), USB_EP_TOGGLE_bm);
+}
+
+/**************************************************************************************************
+* Check if an endpoint is stalled
+*/
+bool usb_ep_is_stalled(uint8_t ep)
+{
+	_USB_EP(ep);
+	return e->CTRL & USB_EP_STALL_bm;
+}
+
 /**************************************************************************************************
 * Start receiving data into buffer from host.
+*
+* On a multi-packet endpoint the transaction completes once len bytes or a short packet
+* have been received, and CNT holds the total.
 */
 inline void usb_ep_start_out(uint8_t ep, uint8_t* data, usb_size len)
 {
 	_USB_EP(ep);
 	e->DATAPTR = (unsigned) data;
+	e->AUXDATA = len;	// for multi-packet
+	e->CNT = 0;
 	LACR16(&(e->STATUS), USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm);
 }
 
@@ -113,6 +242,103 @@ void usb_ep_start_in(uint8_t ep, const uint8_t* data, usb_size size, bool zlp)
 	LACR16(&(e->STATUS), USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm);
 }
 
+/**************************************************************************************************
+* Queue data on the next free bank of a ping-pong IN endpoint. Banks are sent in the order
+* they were queued, so with two banks queued the host never has to wait for firmware.
+*/
+bool usb_ep_queue_in(uint8_t ep, const uint8_t* data, usb_size size, bool zlp)
+{
+	_USB_EP(ep);
+	uint8_t *pp = &usb_xmega_pingpong[ep & 0x3F];
+	uint8_t saved_sreg = SREG;
+	cli();
+
+	uint8_t bank = *pp & USB_PP_FILL_bm;
+	if (*pp & (USB_PP_QUEUED0_bm << bank))
+	{
+		SREG = saved_sreg;
+		return false;
+	}
+
+	USB_EP_t *b = &pair->ep[1 ^ bank];
+	b->DATAPTR = (unsigned) data;
+	b->AUXDATA = 0;	// for multi-packet
+	b->CNT = size | (zlp << 15);
+	*pp = (*pp ^ USB_PP_FILL_bm) | (USB_PP_QUEUED0_bm << bank);
+	if (bank)
+		LACR16(&(e->STATUS), USB_EP_BUSNACK1_bm | USB_EP_TRNCOMPL1_bm);
+	else
+		LACR16(&(e->STATUS), USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm);
+
+	SREG = saved_sreg;
+	return true;
+}
+
+/**************************************************************************************************
+* Queue a buffer on the next free bank of a ping-pong OUT endpoint
+*/
+bool usb_ep_queue_out(uint8_t ep, uint8_t* data, usb_size len)
+{
+	_USB_EP(ep);
+	uint8_t *pp = &usb_xmega_pingpong[ep & 0x3F];
+	uint8_t saved_sreg = SREG;
+	cli();
+
+	uint8_t bank = *pp & USB_PP_FILL_bm;
+	if (*pp & (USB_PP_QUEUED0_bm << bank))
+	{
+		SREG = saved_sreg;
+		return false;
+	}
+
+	USB_EP_t *b = &pair->ep[bank];
+	b->DATAPTR = (unsigned) data;
+	b->AUXDATA = len;	// for multi-packet
+	b->CNT = 0;
+	*pp = (*pp ^ USB_PP_FILL_bm) | (USB_PP_QUEUED0_bm << bank);
+	if (bank)
+		LACR16(&(e->STATUS), USB_EP_BUSNACK1_bm | USB_EP_TRNCOMPL1_bm);
+	else
+		LACR16(&(e->STATUS), USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm);
+
+	SREG = saved_sreg;
+	return true;
+}
+
+/**************************************************************************************************
+* Return the oldest bank of a ping-pong endpoint once the hardware has finished with it.
+* The hardware sets BUSNACKn when a bank completes, so the bank NAKs until queued again.
+*/
+bool usb_ep_dequeue(uint8_t ep, uint8_t** data, usb_size* len)
+{
+	_USB_EP(ep);
+	uint8_t *pp = &usb_xmega_pingpong[ep & 0x3F];
+	uint8_t saved_sreg = SREG;
+	cli();
+
+	uint8_t bank = (*pp & USB_PP_DONE_bm) ? 1 : 0;
+	if (!(*pp & (USB_PP_QUEUED0_bm << bank)) ||
+		!(e->STATUS & (bank ? USB_EP_BUSNACK1_bm : USB_EP_BUSNACK0_bm)))
+	{
+		SREG = saved_sreg;
+		return false;
+	}
+
+	USB_EP_t *b = &pair->ep[!!(ep & 0x80) ^ bank];
+	if (data != NULL)
+		*data = (uint8_t *) b->DATAPTR;
+	if (len != NULL)
+		*len = b->CNT & 0x3FF;
+	*pp = (*pp ^ USB_PP_DONE_bm) & ~(USB_PP_QUEUED0_bm << bank);
+	if (bank)
+		LACR16(&(e->STATUS), USB_EP_TRNCOMPL1_bm);
+	else
+		LACR16(&(e->STATUS), USB_EP_TRNCOMPL0_bm);
+
+	SREG = saved_sreg;
+	return true;
+}
+
 /**************************************************************************************************
 * Check if an endpoint is ready to start the next transaction
 */
@@ -140,6 +366,14 @@ void usb_ep_clear_transaction_complete(uint8_t ep)
 	LACR16(&(e->STATUS), USB_EP_TRNCOMPL0_bm | USB_EP_BUSNACK0_bm);
 }
 
+/**************************************************************************************************
+* Set the completion callback for an endpoint other than EP0
+*/
+void usb_ep_set_callback(uint8_t ep, usb_ep_callback_t callback)
+{
+	usb_xmega_callbacks[(((ep & 0x3F) - 1) << 1) | !!(ep & 0x80)] = callback;
+}
+
 /**************************************************************************************************
 * Get the number of bytes available from a completed transaction on an OUT endpoint
 */
@@ -149,6 +383,52 @@ inline uint16_t usb_ep_get_out_transaction_length(uint8_t ep)
 	return e->CNT;
 }
 
+#ifdef USB_FRAME_COUNTER
+/**************************************************************************************************
+* Extend the 11 bit hardware frame number at each SOF, and latch the frame timer so that
+* samples can be stamped relative to it. Missed SOF interrupts don't lose frames.
+*/
+static inline void usb_frame_sof(void)
+{
+	usb_frame_sof_ticks = USB_FRAME_TIMER.CNT;
+	uint16_t framenum = *(volatile uint16_t *)&usb_xmega_endpoints[usb_num_endpoints + 1];
+	usb_frame += (framenum - (uint16_t)usb_frame) & 0x7FF;
+}
+
+/**************************************************************************************************
+* Get the extended frame number
+*/
+uint32_t usb_frame_counter(void)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	uint32_t frame = usb_frame;
+	SREG = saved_sreg;
+	return frame;
+}
+
+/**************************************************************************************************
+* Get the current time as (frame, ticks since that frame's SOF). If an SOF is pending but
+* not yet handled, the time is moved on to the new frame.
+*/
+void usb_frame_timestamp(usb_timestamp_t *ts)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	uint16_t ticks = USB_FRAME_TIMER.CNT - usb_frame_sof_ticks;
+	uint32_t frame = usb_frame;
+	if ((USB.INTFLAGSASET & USB_SOFIF_bm) && (ticks >= USB_FRAME_TIMER_TICKS))
+	{
+		frame++;
+		ticks -= USB_FRAME_TIMER_TICKS;
+	}
+	SREG = saved_sreg;
+
+	ts->frame = frame;
+	ts->ticks = ticks;
+}
+#endif
+
 /**************************************************************************************************
 * Physically detach from USB bus
 */
@@ -163,10 +443,101 @@ void usb_attach(void) {
 	USB.CTRLB |= USB_ATTACH_bm;
 }
 
+/**************************************************************************************************
+* Handle control requests captured by the transaction complete interrupt. Call regularly
+* from the main loop. The IN data or status stage NAKs until the request has been handled.
+*
+* The handler runs with interrupts enabled. A SETUP that arrives meanwhile is left in the
+* endpoint by the interrupt, so usb_setup and ep0_buf don't change under the handler, and
+* the handler's response is dropped because it is stale. The new request is captured here
+* once the handler has returned.
+*/
+#ifdef USB_DEFERRED_CONTROL
+void usb_poll(void)
+{
+	uint8_t saved_sreg = SREG;
+	cli();
+	uint8_t pending = usb_control_pending;
+	usb_control_pending = 0;
+	usb_control_busy = true;
+	SREG = saved_sreg;
+
+	if (pending & USB_CONTROL_SETUP_PENDING)
+		usb_handle_control_setup();
+	if (pending & USB_CONTROL_IN_PENDING)
+		usb_handle_control_in();
+
+	cli();
+	usb_control_busy = false;
+	if (usb_xmega_endpoints[0].out.STATUS & USB_EP_SETUP_bm)
+		usb_handle_ep0_out();
+	SREG = saved_sreg;
+}
+
+/**************************************************************************************************
+* True if a new SETUP has arrived while usb_poll() runs a handler, whose response must then
+* not be armed
+*/
+bool usb_ep0_superseded(void)
+{
+	return usb_control_busy && (usb_xmega_endpoints[0].out.STATUS & USB_EP_SETUP_bm);
+}
+#endif
+
+/**************************************************************************************************
+* Check if the host has suspended the bus
+*/
+bool usb_is_suspended(void)
+{
+	return usb_suspended;
+}
+
+/**************************************************************************************************
+* Sleep in power-down mode with the USB clock stopped while the bus is suspended. Returns
+* once the host resumes the bus, or once usb_remote_wakeup() has been called, e.g. from a
+* pin change interrupt. The USB clock then stays on for the resume signalling. Resume
+* detection is asynchronous so works without the USB clock.
+*/
+void usb_suspend_sleep(void)
+{
+	for (;;)
+	{
+		cli();
+		if (!usb_suspended || usb_wakeup_requested)
+			break;
+		if (!(USB.CTRLB & USB_RWAKEUP_bm))	// the module needs its clock to signal resume
+			CLK.USBCTRL &= ~CLK_USBSEN_bm;
+		SLEEP.CTRL = SLEEP_SMODE_PDOWN_gc | SLEEP_SEN_bm;
+		sei();							// executes the next instruction before any interrupts
+		__asm__ __volatile__("sleep");
+		SLEEP.CTRL = 0;
+		CLK.USBCTRL |= CLK_USBSEN_bm;
+	}
+	sei();
+}
+
+/**************************************************************************************************
+* Signal remote wakeup to a suspended host, if the host has enabled it. Returns false if
+* it was not sent.
+*/
+bool usb_remote_wakeup(void)
+{
+	if (!usb_suspended || !usb_remote_wakeup_enabled)
+		return false;
+	usb_wakeup_requested = true;		// keeps usb_suspend_sleep() awake until the host resumes
+	CLK.USBCTRL |= CLK_USBSEN_bm;
+	USB.CTRLB |= USB_RWAKEUP_bm;		// cleared by hardware once resume has been signalled
+	return true;
+}
+
 /**************************************************************************************************
 * Clear SETUP OUT stage on the default control pipe
 */
 void usb_ep0_clear_out_setup(void) {
+#ifdef USB_DEFERRED_CONTROL
+	if (usb_ep0_superseded())
+		return;
+#endif
 	LACR16(&usb_xmega_endpoints[0].out.STATUS, USB_EP_SETUP_bm | USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm | USB_EP_OVF_bm | USB_EP_TOGGLE_bm);
 }
 
@@ -174,6 +545,10 @@ void usb_ep0_clear_out_setup(void) {
 * Enable the OUT stage on the default control pipe
 */
 void usb_ep0_out(void) {
+#ifdef USB_DEFERRED_CONTROL
+	if (usb_ep0_superseded())
+		return;
+#endif
 	LACR16(&usb_xmega_endpoints[0].out.STATUS, USB_EP_SETUP_bm | USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm | USB_EP_OVF_bm);
 }
 
@@ -181,6 +556,10 @@ void usb_ep0_out(void) {
 * Enable the IN stage on the default control pipe
 */
 void usb_ep0_in(uint8_t size){
+#ifdef USB_DEFERRED_CONTROL
+	if (usb_ep0_superseded())
+		return;
+#endif
 	usb_ep_start_in(0x80, ep0_buf_in, size, true);
 }
 
@@ -188,6 +567,10 @@ void usb_ep0_in(uint8_t size){
 * Stall the default control pipe
 */
 void usb_ep0_stall(void) {
+#ifdef USB_DEFERRED_CONTROL
+	if (usb_ep0_superseded())
+		return;
+#endif
 	usb_xmega_endpoints[0].out.CTRL |= USB_EP_STALL_bm;
 	usb_xmega_endpoints[0].in.CTRL  |= USB_EP_STALL_bm;
 }
@@ -262,40 +645,126 @@ ISR(USB_BUSEVENT_vect)
 		usb_reset();
 	}
 
-	// start of frame, unused
-	//if (USB.INTFLAGSACLR & USB_SOFIF_bm)
-	//	USB.INTFLAGSACLR = USB_SOFIF_bm;
+	// start of frame
+#ifdef USB_SOF_INTERRUPT
+	if (USB.INTFLAGSACLR & USB_SOFIF_bm)
+	{
+		USB.INTFLAGSACLR = USB_SOFIF_bm;
+#ifdef USB_FRAME_COUNTER
+		usb_frame_sof();
+#endif
+#ifdef USB_ISOCHRONOUS
+		usb_iso_frame();
+#endif
+#ifdef USB_HID_SOF
+		hid_sof();
+#endif
+	}
+#endif
+
+	// bus suspended by host, the device must drop to suspend current within 7ms
+	if (USB.INTFLAGSACLR & USB_SUSPENDIF_bm)
+	{
+		USB.INTFLAGSACLR = USB_SUSPENDIF_bm;
+		usb_suspended = true;
+		usb_cb_suspend();
+	}
 
-	USB.INTFLAGSACLR = USB_SUSPENDIF_bm | USB_RESUMEIF_bm;
+	// bus activity after suspend, either host resume or our remote wakeup
+	if (USB.INTFLAGSACLR & USB_RESUMEIF_bm)
+	{
+		USB.INTFLAGSACLR = USB_RESUMEIF_bm;
+		CLK.USBCTRL |= CLK_USBSEN_bm;
+		usb_suspended = false;
+		usb_wakeup_requested = false;
+		usb_cb_resume();
+	}
 }
 
 /**************************************************************************************************
-* Handle transaction complete interrupts. Uncomment callbacks if required.
+* Run the handler for a control request, or leave it for usb_poll()
 */
-ISR(USB_TRNCOMPL_vect)
+static inline void usb_dispatch_control_setup(void)
 {
-	USB.FIFOWP = 0;	// clear TCIF
-	USB.INTFLAGSBCLR = USB_SETUPIF_bm | USB_TRNIF_bm;
+#ifdef USB_DEFERRED_CONTROL
+	usb_xmega_endpoints[0].out.DATAPTR = (unsigned) usb_setup_landing;
+	usb_control_pending = USB_CONTROL_SETUP_PENDING;	// a new request replaces any pending one
+#else
+	usb_handle_control_setup();
+#endif
+}
 
-	// EP0 (control) OUT/SETUP
+static inline void usb_dispatch_control_in(void)
+{
+#ifdef USB_DEFERRED_CONTROL
+	usb_control_pending |= USB_CONTROL_IN_PENDING;
+#else
+	usb_handle_control_in();
+#endif
+}
+
+/**************************************************************************************************
+* Handle SETUP and OUT data stage completion on the default control pipe
+*/
+static inline void usb_handle_ep0_out(void)
+{
 	uint8_t status = usb_xmega_endpoints[0].out.STATUS;		// Read once to prevent race condition
 	if (status & USB_EP_SETUP_bm)
 	{
-		memcpy(&usb_setup, ep0_buf_out, sizeof(usb_setup));
+#ifdef USB_DEFERRED_CONTROL
+		if (usb_control_busy)
+			return;		// usb_poll() captures it once the running handler has returned
+		// a response armed for the request this one replaces must not be sent
+		LASR16(&usb_xmega_endpoints[0].in.STATUS, USB_EP_BUSNACK0_bm);
+#endif
+		// the setup packet lands wherever DATAPTR was left, which is part way through the
+		// buffer if the host abandoned a data stage
+		memcpy(&usb_setup, (void *)usb_xmega_endpoints[0].out.DATAPTR, sizeof(usb_setup));
+		usb_xmega_endpoints[0].out.DATAPTR = (unsigned) ep0_buf_out;
+		ep0_out_received = 0;
+		ep0_out_pending = false;
 		LACR16(&(usb_xmega_endpoints[0].out.STATUS), USB_EP_TRNCOMPL0_bm | USB_EP_BUSNACK0_bm | USB_EP_SETUP_bm);
 		if (((usb_setup.bmRequestType & 0x80) != 0) ||	// IN host requesting response
 			(usb_setup.wLength == 0))					// OUT but no data
-			usb_handle_control_setup();
-		// else deferred until data stage complete
+			usb_dispatch_control_setup();
+		else if (usb_setup.wLength > USB_EP0_OUT_BUFFER_SIZE)
+			usb_ep0_stall();
+		else
+			ep0_out_pending = true;						// deferred until data stage complete
 	}
 	else if (status & USB_EP_TRNCOMPL0_bm)
 	{
-		usb_handle_control_setup();
-		//usb_handle_control_out();
-		//LACR16(&(usb_xmega_endpoints[0].out.STATUS), USB_EP_TRNCOMPL0_bm);
+		if (!ep0_out_pending)
+		{
+			// status stage of an IN request
+			LACR16(&(usb_xmega_endpoints[0].out.STATUS), USB_EP_TRNCOMPL0_bm);
+			return;
+		}
+
+		uint8_t count = usb_xmega_endpoints[0].out.CNT;
+		ep0_out_received += count;
+		if ((count == USB_EP0_MAX_PACKET_SIZE) && (ep0_out_received < usb_setup.wLength))
+		{
+			// accumulate the next packet after this one
+			usb_xmega_endpoints[0].out.DATAPTR = (unsigned)(ep0_buf_out + ep0_out_received);
+			LACR16(&(usb_xmega_endpoints[0].out.STATUS), USB_EP_TRNCOMPL0_bm | USB_EP_BUSNACK0_bm);
+			return;
+		}
+
+		// wLength bytes or a short packet ends the data stage. BUSNACK0 stays set until the
+		// request handler accepts the data.
+		ep0_out_pending = false;
+		usb_xmega_endpoints[0].out.DATAPTR = (unsigned) ep0_buf_out;
+		LACR16(&(usb_xmega_endpoints[0].out.STATUS), USB_EP_TRNCOMPL0_bm);
+		usb_dispatch_control_setup();
 	}
+}
 
-	// EP0 (control) IN
+/**************************************************************************************************
+* Handle IN data stage completion on the default control pipe
+*/
+static inline void usb_handle_ep0_in(void)
+{
 	if (usb_xmega_endpoints[0].in.STATUS & USB_EP_TRNCOMPL0_bm)
 	{
 		// SET_ADDRESS requests must only take effect after the response IN packet has
@@ -305,16 +774,79 @@ ISR(USB_TRNCOMPL_vect)
 			if (usb_setup.bRequest == USB_REQ_SetAddress)
 					USB.ADDR = usb_setup.wValue & 0x7F;
 		}
-		//usb_handle_control_in();
 		LACR16(&usb_xmega_endpoints[0].in.STATUS, USB_EP_TRNCOMPL0_bm);
+		usb_dispatch_control_in();
+	}
+}
+
+/**************************************************************************************************
+* Handle a completed transaction on any other endpoint. index is the endpoint's position
+* in the endpoint table, i.e. endpoint number * 2 + direction.
+*
+* Without a callback, IN completions are cleared so that usb_ep_is_ready() returns true and
+* OUT completions are left pending for usb_ep_is_transaction_complete().
+*/
+static inline void usb_handle_ep_transaction_complete(uint8_t index)
+{
+	USB_EP_t *e = &usb_xmega_endpoints[index >> 1].ep[index & 1];
+	usb_ep_callback_t callback = usb_xmega_callbacks[index - 2];
+
+	if (!(e->STATUS & (USB_EP_TRNCOMPL0_bm | USB_EP_TRNCOMPL1_bm)))
+		return;
+
+	if (callback != NULL)
+	{
+		LACR16(&(e->STATUS), USB_EP_TRNCOMPL0_bm | USB_EP_TRNCOMPL1_bm);
+		callback((index >> 1) | ((index & 1) << 7));
 	}
+	else if (index & 1)
+		LACR16(&(e->STATUS), USB_EP_TRNCOMPL0_bm);
+}
+
+#ifdef USB_FIFO
+/**************************************************************************************************
+* Handle transaction complete interrupts. The FIFO holds the address of each endpoint
+* that completed a transaction, so only those endpoints are serviced.
+*/
+ISR(USB_TRNCOMPL_vect)
+{
+	USB.INTFLAGSBCLR = USB_SETUPIF_bm | USB_TRNIF_bm;
 
-	// EP1 IN
-	if (usb_xmega_endpoints[1].in.STATUS & USB_EP_TRNCOMPL0_bm)
+	// SETUP packets are signalled by SETUPIF rather than the FIFO
+	usb_handle_ep0_out();
+
+	while (USB.FIFOWP != usb_fifo_rp)
 	{
-		LACR16(&usb_xmega_endpoints[1].in.STATUS, USB_EP_TRNCOMPL0_bm);
+		usb_fifo_rp = USB.FIFORP;	// reading pops the next entry
+		uint16_t entry = ((uint16_t *)usb_xmega_endpoints)[(int8_t)usb_fifo_rp];
+		uint8_t index = (entry - (uint16_t)(unsigned)usb_xmega_endpoints) / sizeof(USB_EP_t);
+
+		if (index == 0)
+			continue;	// EP0 OUT, already handled above
+		else if (index == 1)
+			usb_handle_ep0_in();
+		else
+			usb_handle_ep_transaction_complete(index);
 	}
+}
+
+#else
+/**************************************************************************************************
+* Handle transaction complete interrupts. Every endpoint is checked for completions.
+*/
+ISR(USB_TRNCOMPL_vect)
+{
+	USB.FIFOWP = 0;	// clear TCIF
+	USB.INTFLAGSBCLR = USB_SETUPIF_bm | USB_TRNIF_bm;
+
+	// EP0 (control) OUT/SETUP
+	usb_handle_ep0_out();
 
-	// empty callback
-	//usb_cb_completion();
+	// EP0 (control) IN
+	usb_handle_ep0_in();
+
+	// EP1 onwards, OUT and IN
+	for (uint8_t i = 2; i < ((usb_num_endpoints + 1) << 1); i++)
+		usb_handle_ep_transaction_complete(i);
 }
+#endif
@@ -23,27 +23,63 @@ typedef union USB_EP_pair{
 	};
 } __attribute__((packed)) USB_EP_pair_t;
 
-//extern USB_EP_pair_t *usb_xmega_endpoints;	// for FIFO mode
+// The transaction complete FIFO sits directly below the endpoint table, one 16-bit
+// entry per endpoint direction. The frame number is stored directly above it. When
+// either is used the table is part of a larger block of RAM.
+#ifdef USB_FIFO
+#define USB_EPPTR_FIFO(NUM_EP)		uint8_t fifo_buffer[((NUM_EP)+1)*4];
+#else
+#define USB_EPPTR_FIFO(NUM_EP)
+#endif
+#ifdef USB_FRAME_COUNTER
+#define USB_EPPTR_FRAMENUM			uint16_t framenum;
+#else
+#define USB_EPPTR_FRAMENUM
+#endif
+
+#if defined(USB_FIFO) || defined(USB_FRAME_COUNTER)
+extern USB_EP_pair_t * const usb_xmega_endpoints;
+#else
 extern USB_EP_pair_t usb_xmega_endpoints[];
+#endif
 extern const uint8_t usb_num_endpoints;
+extern uint8_t usb_xmega_pingpong[];
+extern usb_ep_callback_t usb_xmega_callbacks[];
 
-/* FIFO mode
+#if defined(USB_FIFO) || defined(USB_FRAME_COUNTER)
 #define USB_ENDPOINTS(NUM_EP) \
 	const uint8_t usb_num_endpoints = (NUM_EP); \
 	struct { \
-		uint8_t fifo_buffer[((NUM_EP)+1)*4]; \
+		USB_EPPTR_FIFO(NUM_EP) \
 		USB_EP_pair_t usb_xmega_endpoints[(NUM_EP)+1]; \
+		USB_EPPTR_FRAMENUM \
 	} epptr_ram __attribute__((aligned(2))); \
-	USB_EP_pair_t *usb_xmega_endpoints = epptr_ram.usb_xmega_endpoints;
-*/
-
+	USB_EP_pair_t * const usb_xmega_endpoints = epptr_ram.usb_xmega_endpoints; \
+	uint8_t usb_xmega_pingpong[(NUM_EP)+1]; \
+	usb_ep_callback_t usb_xmega_callbacks[(NUM_EP)*2];
+#else
 #define USB_ENDPOINTS(NUM_EP) \
 	const uint8_t usb_num_endpoints = (NUM_EP); \
-	USB_EP_pair_t usb_xmega_endpoints[(NUM_EP)+1] __attribute__((aligned(2)));
+	USB_EP_pair_t usb_xmega_endpoints[(NUM_EP)+1] __attribute__((aligned(2))); \
+	uint8_t usb_xmega_pingpong[(NUM_EP)+1]; \
+	usb_ep_callback_t usb_xmega_callbacks[(NUM_EP)*2];
+#endif
+
+// Ping-pong endpoint bank state, one byte per endpoint number
+#define USB_PP_FILL_bm		0x01		// next bank to queue
+#define USB_PP_DONE_bm		0x02		// oldest queued bank
+#define USB_PP_QUEUED0_bm	0x04		// bank 0 owned by hardware or awaiting dequeue
+#define USB_PP_QUEUED1_bm	0x08		// bank 1 owned by hardware or awaiting dequeue
+
 
+/// Send size bytes from far flash address on endpoint 0, one packet at a time
+void usb_ep0_in_flash(uint32_t address, uint16_t size);
 
-/// Copy data from program memory to the ep0 IN buffer
-const uint8_t* usb_ep0_from_progmem(const uint8_t* addr, uint16_t size);
+/// Fills buf with len bytes starting at offset into generated data
+typedef void (*usb_ep0_generator_t)(uint8_t *buf, uint16_t offset, uint8_t len);
+
+/// Send size bytes produced by generator on endpoint 0, one packet at a time
+void usb_ep0_in_generator(usb_ep0_generator_t generator, uint16_t size);
 
 /// Send size bytes from ep0_buf_in on endpoint 0
 void usb_ep0_in(uint8_t size);
@@ -57,6 +93,11 @@ void usb_ep0_out(void);
 /// Stall endpoint 0
 void usb_ep0_stall(void);
 
+#ifdef USB_DEFERRED_CONTROL
+/// True if a SETUP arrived while usb_poll() runs a handler, its response is then dropped
+bool usb_ep0_superseded(void);
+#endif
+
 /// Internal common methods called by the hardware API
 void usb_handle_control_setup(void);
 void usb_handle_control_out(void);
@@ -34,6 +34,13 @@ extern uint8_t	NVM_read_production_signature_byte(uint8_t index);
 extern uint8_t	NVM_read_user_signature_byte(uint16_t index);
 extern uint32_t	NVM_application_crc(void);
 extern uint32_t	NVM_boot_crc(void);
+extern uint32_t	NVM_flash_range_crc(uint32_t start, uint32_t end);	// end is the last byte
+extern uint8_t	NVM_read_eeprom_byte(uint16_t address);
+extern void		NVM_erase_write_eeprom_page(uint16_t address);
+
+// Self programming, only from the boot section. The NVM is busy until the write completes.
+extern void		NVM_load_flash_page(const uint8_t *data);
+extern void		NVM_erase_write_app_page(uint32_t address);
 
 
 #endif /* XMEGA_H_ */
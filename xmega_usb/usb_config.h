@@ -8,6 +8,8 @@
 #ifndef USB_CONFIG_H_
 #define USB_CONFIG_H_
 
+#include <avr/pgmspace.h>
+
 
 /****************************************************************************************
 * USB configuration
@@ -35,6 +37,38 @@
 #define	USB_SERIAL_NUMBER
 
 
+// Use the transaction complete FIFO. The interrupt handler then only services
+// endpoints that have completed a transaction, instead of polling each one.
+//#define USB_FIFO
+
+// Accept control OUT data stages (SET_REPORT, vendor writes) of up to this many bytes.
+// Packets are accumulated before the request is handled. Without it the limit is one
+// 64 byte packet. Must be a multiple of 64.
+//#define USB_CONTROL_OUT_BUFFER_SIZE	512
+
+// Handle control requests in the main loop instead of the transaction complete interrupt.
+// The interrupt only captures the setup packet and EP0 NAKs until usb_poll() is called.
+//#define USB_DEFERRED_CONTROL
+
+
+/****************************************************************************************
+* Suspend and resume
+*/
+// Advertise remote wakeup, see usb_remote_wakeup()
+//#define USB_REMOTE_WAKEUP
+
+// Called from the bus event interrupt when the host suspends the bus. The device must
+// drop to suspend current, e.g. by calling usb_suspend_sleep() from the main loop.
+static inline void usb_cb_suspend(void)
+{
+}
+
+// Called from the bus event interrupt when the bus is resumed
+static inline void usb_cb_resume(void)
+{
+}
+
+
 /****************************************************************************************
 * Use Microsoft WCID descriptors
 */
@@ -44,52 +78,263 @@
 #define WCID_REQUEST_ID			0x22
 #define WCID_REQUEST_ID_STR		u"\x22"
 
+// DeviceInterfaceGUID(s) for USB_WCID_EXTENDED, shared by the WCID and MS OS 2.0 descriptors
+#define WCID_DEVICE_INTERFACE_GUID	L"{42314231-5A81-49F0-BC3D-A4FF138216D7}"
+
+// Also provide Microsoft OS 2.0 descriptors through a BOS descriptor (bcdUSB 0x0201).
+// Windows 8.1 and later bind WinUSB from the BOS descriptor and one vendor request,
+// older versions still use the descriptors above.
+//#define USB_WCID_MSOS20
+
+
+/****************************************************************************************
+* Vendor register map, typed parameters read and written with vendor control requests
+*/
+//#define USB_REGMAP
+
+// Called after the host has written count registers, starting at register first
+static inline void regmap_cb_written(uint16_t first, uint8_t count)
+{
+}
+
+// Register table, addressed by position. Names are up to REGMAP_NAME_LENGTH characters.
+#if defined(USB_REGMAP) && defined(REGMAP_DECLARE_TABLE)
+extern uint16_t example_gain;
+extern int16_t example_offset;
+extern uint32_t example_sample_count;
+
+const __flash regmap_entry_t regmap_table[] = {
+	REGMAP_ENTRY(example_gain,			REGMAP_TYPE_U16,	0,							"gain"),
+	REGMAP_ENTRY(example_offset,		REGMAP_TYPE_S16,	0,							"offset"),
+	REGMAP_ENTRY(example_sample_count,	REGMAP_TYPE_U32,	REGMAP_FLAG_READONLY_bm,	"samples"),
+};
+#endif	// defined(USB_REGMAP) && defined(REGMAP_DECLARE_TABLE)
+
 
 /****************************************************************************************
-* DFU (Device Firmware Update) run-time interface
+* DFU (Device Firmware Update) run-time interface and DFU mode
 */
 #define USB_DFU_RUNTIME
 
+#define DFU_LOAD_MAGIC			0x4c4f4144	// "LOAD", left at the start of SRAM for the bootloader
+
 extern void	CCPWrite(volatile uint8_t *address, uint8_t value);
 static inline void dfu_cb_enter_dfu_mode(void)
 {
-	*(uint32_t *)(INTERNAL_SRAM_START) = 0x4c4f4144;	// "LOAD"
+	*(uint32_t *)(INTERNAL_SRAM_START) = DFU_LOAD_MAGIC;
 	// watchdog reset gives USB time to send response
 	asm("wdr");
 	CCPWrite(&WDT.CTRL, WDT_WPER_128CLK_gc | WDT_ENABLE_bm | WDT_WCEN_bm);
 }
 
+// DFU mode, a bootloader that programs the application section (alternate setting 0)
+// and the EEPROM (alternate setting 1). It is the only interface, so undefine USB_HID,
+// USB_DFU_RUNTIME and the other interfaces, and link the firmware into the boot section.
+//#define USB_DFU_MODE
+#define USB_DFU_FLASH_WRITE_MS		8	// page erase and write time, from the datasheet
+#define USB_DFU_EEPROM_WRITE_MS		8
+#define USB_DFU_VERIFY_MS			4	// range CRC of a full application section
+// Refuse flash images without a CRC trailer (DFU_ImageTrailer_t), otherwise only images
+// that have one are checked
+//#define USB_DFU_REQUIRE_CRC
+// Alternate setting 2 ("Flash patch") accepts a compressed stream of literal, fill and
+// copy commands, decoded into the application section by dfu_poll(). Copies read the
+// current flash, so small changes to the firmware only send the bytes that changed.
+#define USB_DFU_PATCH
+
+// Called by the bootloader at reset, before anything has been set up. Return true to stay
+// in DFU mode, false to start the application. load_requested is true after
+// dfu_cb_enter_dfu_mode(). A blank application section also stays, add any other entry
+// conditions such as a button here.
+static inline bool dfu_cb_stay_in_bootloader(bool load_requested)
+{
+	return load_requested || (pgm_read_word_far(APP_SECTION_START) == 0xFFFF);
+}
+
+// Called from dfu_poll() once the new firmware has been written. The watchdog reset gives
+// USB time to send the last status response, then the bootloader starts the application.
+static inline void dfu_cb_manifest(void)
+{
+	asm("wdr");
+	CCPWrite(&WDT.CTRL, WDT_WPER_128CLK_gc | WDT_ENABLE_bm | WDT_WCEN_bm);
+}
+
+
+/****************************************************************************************
+* Extended frame counter and (frame, sub-frame tick) timestamps, see usb_frame_timestamp()
+*/
+//#define USB_FRAME_COUNTER
+#define USB_FRAME_TIMER			TCC1				// free running, latched at each SOF
+#define USB_FRAME_TIMER_CLKSEL	TC_CLKSEL_DIV1_gc
+#define USB_FRAME_TIMER_TICKS	(F_CPU / 1000UL)	// timer ticks per 1ms frame
+#define USB_FRAME_TIMER_CCA_vect	TCC1_CCA_vect	// compare A, used by USB_HID_LOW_LATENCY
+
+
+/****************************************************************************************
+* Ring buffered streaming over the vendor specific bulk endpoints
+*/
+// Producers write into a ring that is sent on endpoint 0x81 straight from the buffer
+//#define USB_STREAM_IN
+#define USB_STREAM_IN_SIZE		1024		// must be a power of two
+
+// Packets from the host on endpoint 0x02 are received into a ring of 64 byte slots.
+// The endpoint NAKs while the ring is full.
+//#define USB_STREAM_OUT
+#define USB_STREAM_OUT_PACKETS	8			// must be a power of two
+
+
+/****************************************************************************************
+* DMA driven peripheral to bulk IN pipeline on endpoint 0x81, see usb_dma_in_start()
+*/
+//#define USB_DMA_IN
+#define USB_DMA_IN_BUFFER_SIZE	512			// bytes per block, at most 1023
+
+
+/****************************************************************************************
+* Isochronous streaming interface, one IN (0x83) and one OUT (0x03) packet per frame
+*/
+//#define USB_ISOCHRONOUS
+#define USB_ISO_IN_SIZE			256			// bytes per frame, at most 1023
+#define USB_ISO_OUT_SIZE		256			// bytes per frame, at most 1023
+
+// Called from the start of frame interrupt. Write the next IN packet into *packet and
+// return its length, at most USB_ISO_IN_SIZE.
+static inline uint16_t usb_cb_iso_in(uint8_t *packet)
+{
+	return 0;
+}
+
+// Called from the start of frame interrupt with the packet received in the last frame
+static inline void usb_cb_iso_out(const uint8_t *packet, uint16_t len)
+{
+}
+
+
+/****************************************************************************************
+* CDC-ACM virtual serial port. Data is carried by USB_STREAM_IN and USB_STREAM_OUT, which
+* are enabled automatically. Not available with USB_HID.
+*/
+//#define USB_CDC
+
+// Called when the host changes the baud rate or frame format. stop_bits, parity are
+// encoded as in CDC_LineCoding_t.
+static inline void cdc_cb_set_line_coding(uint32_t baud, uint8_t stop_bits, uint8_t parity, uint8_t data_bits)
+{
+}
+
+// Called when the host sets DTR and RTS (CDC_LINE_STATE_*), e.g. when a terminal opens
+static inline void cdc_cb_set_control_line_state(uint8_t state)
+{
+}
+
+// Called when the host sends a break of duration_ms (0xFFFF = until cleared with 0)
+static inline void cdc_cb_send_break(uint16_t duration_ms)
+{
+}
+
+
+/****************************************************************************************
+* Mass storage (bulk-only transport, SCSI) on the bulk endpoints. Not available with
+* USB_HID or USB_CDC. Call msc_poll() from the main loop.
+*/
+//#define USB_MSC
+#define MSC_BLOCK_SIZE			512
+#define MSC_INQUIRY_VENDOR		"Example"			// up to 8 characters
+#define MSC_INQUIRY_PRODUCT		"Example Storage"	// up to 16 characters
+#define MSC_INQUIRY_REVISION	"1.00"				// up to 4 characters
+
+// Block device backend. The example exposes the application section of the flash as a
+// read only disk.
+static inline uint32_t msc_cb_block_count(void)
+{
+	return APP_SECTION_SIZE / MSC_BLOCK_SIZE;
+}
+
+static inline bool msc_cb_write_protected(void)
+{
+	return true;
+}
+
+// Read one block into buffer, return false on error
+static inline bool msc_cb_read_block(uint32_t lba, uint8_t *buffer)
+{
+	memcpy_PF(buffer, lba * MSC_BLOCK_SIZE, MSC_BLOCK_SIZE);
+	return true;
+}
+
+// Write one block from buffer, return false on error
+static inline bool msc_cb_write_block(uint32_t lba, const uint8_t *buffer)
+{
+	return false;
+}
+
+
+/****************************************************************************************
+* Composite device, e.g. HID and vendor bulk endpoints at the same time
+*/
+//#define USB_COMPOSITE
+
+// Functions in interface order, X(HID), X(VENDOR) or X(DFU_RUNTIME). Interface and
+// endpoint numbers are assigned in the same order at compile time.
+#define USB_COMPOSITE_FUNCTIONS(X)		X(HID) X(VENDOR) X(DFU_RUNTIME)
+#define USB_COMPOSITE_WCID_INTERFACE	USB_INTERFACE_VENDOR	// interface that WinUSB binds to
+
 
 /****************************************************************************************
 * Enable HID, otherwise vendor specific bulk endpoints
 */
 #define USB_HID
-#define USB_HID_REPORT_SIZE		3
 #define USB_HID_POLL_RATE_MS	0x08		// HID polling rate in milliseconds
 
+// Input reports are queued per report ID and sent from the IN completion interrupt.
+// USB_HID_REPORT_IDS is the number of report IDs (1 to N) in the report descriptor, or 0
+// if it doesn't use report IDs. USB_HID_REPORT_SIZE is then the size of the largest
+// report, excluding the ID.
+// HID_INPUT_FIELDS below emits no REPORT_ID items, so using report IDs also means adding
+// REPORT_ID items and per-ID fields to hid_report_descriptor by hand.
+#define USB_HID_REPORT_IDS		0
+#define USB_HID_QUEUE_DEPTH		2			// reports per ID, must be a power of two
+// When a queue is full, replace the newest waiting report instead of refusing the new
+// one. The host always gets the latest state, intermediate states may be skipped.
+#define USB_HID_COALESCE
+
+// Support SET_IDLE/GET_IDLE. Reports that haven't changed are not sent, the last state of
+// each report is repeated at the host's idle rate, counted in start of frame interrupts.
+//#define USB_HID_IDLE
+#define USB_HID_DEFAULT_IDLE	0			// 4ms units, 0 = only send changes (mice, joysticks)
+
+// Call hid_cb_sample() USB_HID_SAMPLE_LEAD_US before each poll of the HID IN endpoint,
+// so the report the host collects is fresh instead of up to a polling interval old. The
+// poll frame is learned from completed transfers, and USB_FRAME_TIMER compare A times
+// the sample within the frame. Enables USB_FRAME_COUNTER.
+//#define USB_HID_LOW_LATENCY
+#define USB_HID_SAMPLE_LEAD_US	150			// time to sample, post and arm the endpoint
+
+#include "hid_items.h"
+
+// Input report fields, X(report size, report count, input flags, items...). The INPUT
+// items of the report descriptor and USB_HID_REPORT_SIZE are both generated from this
+// list, so they always agree.
+#define HID_INPUT_FIELDS(X) \
+	X(1, 8, HID_DATA_VAR_ABS,							/* 8 buttons */ \
+	  HID_USAGE_PAGE(0x09),								/*   USAGE_PAGE (Button) */ \
+	  HID_USAGE_MINIMUM(1), HID_USAGE_MAXIMUM(8),		/*   Button 1 to 8 */ \
+	  HID_LOGICAL_MINIMUM(0), HID_LOGICAL_MAXIMUM(1)) \
+	X(8, 2, HID_DATA_VAR_ABS,							/* X and Y axes */ \
+	  HID_USAGE_PAGE(0x01),								/*   USAGE_PAGE (Generic Desktop) */ \
+	  HID_USAGE(0x30), HID_USAGE(0x31),					/*   USAGE (X), USAGE (Y) */ \
+	  HID_LOGICAL_MINIMUM(-127), HID_LOGICAL_MAXIMUM(127))
+
+#define USB_HID_REPORT_SIZE		HID_INPUT_REPORT_SIZE(HID_INPUT_FIELDS)
+
 
 // HID report descriptor
 #if defined(USB_HID) && defined(HID_DECLARE_REPORT_DESCRIPTOR)
 const __flash uint8_t hid_report_descriptor[] = {
-	0x05, 0x01,					// USAGE_PAGE (Generic Desktop)
-	0x09, 0x04,					// USAGE (Joystick)
-	0xa1, 0x00,					// COLLECTION (Physical)
-	0x05, 0x09,					//   USAGE_PAGE (Button)
-	0x19, 0x01,					//   USAGE_MINIMUM (Button 1)
-	0x29, 0x08,					//   USAGE_MAXIMUM (Button 8)
-	0x15, 0x00,					//   LOGICAL_MINIMUM (0)
-	0x25, 0x01,					//   LOGICAL_MAXIMUM (1)
-	0x95, 0x08,					//   REPORT_COUNT (8)
-	0x75, 0x01,					//   REPORT_SIZE (1)
-	0x81, 0x02,					//   INPUT (Data,Var,Abs)
-	0x05, 0x01,					//   USAGE_PAGE (Generic Desktop)
-	0x09, 0x30,					//   USAGE (X)
-	0x09, 0x31,					//   USAGE (Y)
-	0x15, 0x81,					//   LOGICAL_MINIMUM (-127)
-	0x25, 0x7f,					//   LOGICAL_MAXIMUM (127)
-	0x75, 0x08,					//   REPORT_SIZE (8)
-	0x95, 0x02,					//   REPORT_COUNT (2)
-	0x81, 0x02,					//   INPUT (Data,Var,Abs)
+	HID_USAGE_PAGE(0x01),		// USAGE_PAGE (Generic Desktop)
+	HID_USAGE(0x04),			// USAGE (Joystick)
+	HID_COLLECTION(HID_COLLECTION_PHYSICAL),
+	HID_INPUT_FIELDS(HID_INPUT_FIELD_ITEMS)
 
 	0x95, 0x03,					//	 REPORT_COUNT (3)
 	0x09, 0x00,					//	 USAGE (Undefined)
@@ -101,7 +346,6 @@ const __flash uint8_t hid_report_descriptor[] = {
 
 	0xc0						// END_COLLECTION
 };
-_Static_assert(sizeof(hid_report_descriptor) <= USB_EP0_BUFFER_SIZE, "HID descriptor exceeds EP0 buffer size");
 _Static_assert(USB_HID_REPORT_SIZE <= USB_EP0_BUFFER_SIZE, "HID report exceeds EP0 buffer size");
 #endif	// defined(USB_HID) && defined(HID_DECLARE_REPORT_DESCRIPTOR)
 
@@ -111,8 +355,7 @@ _Static_assert(USB_HID_REPORT_SIZE <= USB_EP0_BUFFER_SIZE, "HID report exceeds E
 #include <hid.h>
 static inline int16_t hid_cb_get_report_input(uint8_t *report, uint8_t report_id)
 {
-	memcpy(report, hid_report, sizeof(hid_report));
-	return sizeof(hid_report);
+	return hid_get_last_report(report_id, report);
 }
 
 static inline int16_t hid_cb_get_report_output(uint8_t *report, uint8_t report_id)
@@ -142,5 +385,12 @@ static inline bool hid_cb_set_report_feature(uint8_t *report, uint16_t report_le
 	return false;
 }
 
+// Low latency sampling, called from the USB_FRAME_TIMER compare interrupt shortly before
+// the host polls. Fill in *report (USB_HID_REPORT_SIZE bytes, no report ID).
+static inline void hid_cb_sample(uint8_t *report)
+{
+	memset(report, 0, USB_HID_REPORT_SIZE);
+}
+
 
 #endif /* USB_CONFIG_H_ */